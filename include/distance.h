@@ -0,0 +1,76 @@
+#ifndef DISTANCE_NETCDF
+#define DISTANCE_NETCDF
+
+#include "structs.h"
+
+/* Sum of squared differences of two windows, other types (scalar) */
+#define SQDIST_WINDOW(TYPE)                                                \
+    case TYPE:                                                             \
+    {                                                                      \
+        const TYPE_VAR_##TYPE *x = (const TYPE_VAR_##TYPE *)var->data + a; \
+        const TYPE_VAR_##TYPE *y = (const TYPE_VAR_##TYPE *)var->data + b; \
+        for (int j = 0; j < n; j++)                                        \
+        {                                                                  \
+            double diff = x[j] - y[j];                                     \
+            sum += diff * diff;                                            \
+        }                                                                  \
+    };                                                                     \
+    break;
+
+/*
+ * Squared-distance kernels over n contiguous values: the difference is
+ * taken in the type of the data and squared and summed in double. One
+ * implementation per instruction set; distance_init picks the widest the
+ * CPU supports.
+ */
+typedef double (*sqdist_float_func)(const float *, const float *, int);
+typedef double (*sqdist_double_func)(const double *, const double *, int);
+
+extern sqdist_float_func sqdist_float;
+extern sqdist_double_func sqdist_double;
+
+/*
+ * Early-abandoning variant: the partial sum is checked after each block
+ * of the instruction set and returned as soon as it reaches limit (the
+ * result is then >= limit, and so is the full sum). Below limit it is the
+ * same value as sqdist_double.
+ */
+typedef double (*sqdist_double_limit_func)(const double *, const double *, int, double);
+
+extern sqdist_double_limit_func sqdist_double_limit;
+
+/*
+ * Window sizes (2k+1) with a fully unrolled kernel, and the largest number
+ * of series summed by an unrolled super-window kernel. Other sizes take
+ * the generic loop.
+ */
+#define SQDIST_WIN_SIZES(M, ISA, TARGET) \
+    M(ISA, TARGET, 5) M(ISA, TARGET, 7) M(ISA, TARGET, 11) M(ISA, TARGET, 13) M(ISA, TARGET, 21)
+#define SQDIST_MAX_WIN 21
+#define SQDIST_MAX_SERIES 8
+
+/* Super-window kernel: columns of each series, windows starting at a and b */
+typedef double (*sqdist_series_func)(const void *const *, int, int);
+
+/* Dispatch tables of one instruction set, indexed by [series][win_size] */
+typedef struct
+{
+    const char *isa;
+    sqdist_float_func window_float;
+    sqdist_double_func window_double;
+    sqdist_double_limit_func window_double_limit;
+    sqdist_float_func fixed_float[SQDIST_MAX_WIN + 1];
+    sqdist_double_func fixed_double[SQDIST_MAX_WIN + 1];
+    sqdist_series_func series_float[SQDIST_MAX_SERIES + 1][SQDIST_MAX_WIN + 1];
+    sqdist_series_func series_double[SQDIST_MAX_SERIES + 1][SQDIST_MAX_WIN + 1];
+} DistanceKernels;
+
+/* Quantized (int16) windows: integer differences, squared and summed in double */
+double sqdist_short(const short *, const short *, int);
+
+void distance_init(void);
+const char *distance_isa(void);
+double window_sqdist(const Variable *, int, int, int);
+double series_sqdist(NetCDF *, int, int, int, int, int, int);
+
+#endif
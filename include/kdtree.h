@@ -2,6 +2,8 @@
 #define PROCESS_KDTREE
 
 #include "structs.h"
+#include "distance.h"
+#include "topk.h"
 
 #define IFNAN_KDTREE(TYPE)                                                           \
     case TYPE:                                                                       \
@@ -38,19 +40,6 @@
     };                                                                                   \
     break;
 
-#define MONACHESW_KDTREE(TYPE)                                                           \
-    case TYPE:                                                                           \
-    {                                                                                    \
-        for (int x = 0; x < ds->win_size; x++)                                           \
-        {                                                                                \
-            double diff =                                                                \
-                ((TYPE_VAR_##TYPE *)file[f].var[i].data)[(target_id - ds->k) + x] -      \
-                ((TYPE_VAR_##TYPE *)file[f].var[i].data)[(root->window_id - ds->k) + x]; \
-            sum += diff * diff;                                                          \
-        }                                                                                \
-    };                                                                                   \
-    break;
-
 #define IF_STORED(TYPE)                                                              \
     case TYPE:                                                                       \
     {                                                                                \
@@ -129,13 +118,30 @@ typedef struct
 } WorkerData;
 
 // /* --- kdtree 3 ---
-// Node pool for efficient memory management
+// Node arena: the nodes of a tree in one aligned block, reserved for the
+// number of points before the build, reset in O(1) between trees and freed
+// at once. Nodes past the reservation come from overflow chunks of at least
+// NODE_POOL_SIZE nodes, merged into the block on the next reset.
 #define NODE_POOL_SIZE 1000
+#define NODE_ARENA_ALIGNMENT 64
 typedef struct
 {
-    KDTree nodes[NODE_POOL_SIZE];
-    int next_available;
-} NodePool;
+    void *block;        // capacity nodes, NODE_ARENA_ALIGNMENT aligned
+    size_t node_size;
+    int capacity;
+    int next_available; // Nodes handed out from block
+    void *chunks;       // Overflow chunks, newest first
+    int chunk_capacity; // Nodes in the newest chunk
+    int chunk_used;
+    int overflow;       // Nodes handed out from chunks since the last reset
+} NodeArena;
+NodeArena *node_arena_create(size_t node_size);
+void node_arena_reserve(NodeArena *arena, int count);
+void *node_arena_alloc(NodeArena *arena);
+void node_arena_reset(NodeArena *arena);
+void node_arena_free(NodeArena *arena);
+
+typedef NodeArena NodePool;
 NodePool *create_node_pool();
 KDTree *allocate_node_from_pool(NodePool *pool, int window_id);
 void reset_node_pool(NodePool *pool);
@@ -0,0 +1,89 @@
+#ifndef NCCACHE_NETCDF
+#define NCCACHE_NETCDF
+
+#include <stdint.h>
+
+#include "structs.h"
+
+/* Preprocessed dataset image ("<cache_dir>/<key>.anc") */
+#define NCCACHE_MAGIC "ANENCACHE"
+#define NCCACHE_VERSION 1
+#define NCCACHE_ALIGN 64
+#define NCCACHE_EXTENSION ".anc"
+#define NCCACHE_SHM_PREFIX "/anen-" // Shared-memory copy of the image (nccache_serve)
+
+/* Source file the image was built from */
+typedef struct
+{
+    uint64_t hash;       // Content hash of the whole file
+    uint64_t size;       // Size in bytes (with mtime, skips rehashing)
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} NcCacheSource;
+
+/* Parameters the preprocessing depends on (part of the key) */
+typedef struct
+{
+    int32_t nfiles;
+    int32_t k;
+    int32_t win_size;
+    int32_t win_size_interpolation;
+    int32_t read_slab;
+    int32_t store_type;
+    int64_t time_start_training;
+    int64_t time_end_training;
+    int64_t time_start_prediction;
+    int64_t time_end_prediction;
+} NcCacheParams;
+
+/* Image header, followed by one NcCacheFile block per source */
+typedef struct
+{
+    char magic[16];
+    uint32_t version;
+    uint32_t header_size; // Bytes before the first column
+    uint64_t size;        // Total size of the image
+    NcCacheParams params;
+    int32_t start_training; // Period indices resolved when the image was built
+    int32_t end_training;
+    int32_t start_prediction;
+    int32_t end_prediction;
+} NcCacheHeader;
+
+/* Per source: NcCacheFile, ndims Dimension, nvars NcCacheVar */
+typedef struct
+{
+    NcCacheSource source;
+    int32_t ndims;
+    int32_t nvars;
+    uint64_t offset; // Slab offset (NetCDF.offset)
+} NcCacheFile;
+
+typedef struct
+{
+    char name[NC_MAX_NAME + 1];
+    int32_t type;
+    int32_t id;
+    int32_t invalid_count;
+    int32_t num_win_valid_training;
+    int32_t num_win_valid_prediction;
+    double invalid_percentage;
+    uint64_t data_offset; // Column start, NCCACHE_ALIGN aligned
+    uint64_t count;       // Number of elements of the column
+} NcCacheVar;
+
+/* Mapping of a loaded image, shared by every NetCDF of the dataset */
+typedef struct NcCache
+{
+    unsigned char *base;
+    size_t size;
+} NcCache;
+
+NetCDF *nccache_load(DataSegment *, char *[]);
+NetCDF *nccache_attach(DataSegment *, char *[]);
+NetCDF *nccache_store(NetCDF *, DataSegment *, char *[]);
+void nccache_serve(NetCDF *, DataSegment *, char *[]);
+void nccache_release_variable(NetCDF *, int);
+void nccache_close(NetCDF *);
+
+#endif
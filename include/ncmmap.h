@@ -0,0 +1,44 @@
+#ifndef NCMMAP_NETCDF
+#define NCMMAP_NETCDF
+
+#include "structs.h"
+
+/* Magic numbers and tags of the classic (CDF-1/2/5) format header */
+#define NCMAP_MAGIC "CDF"
+#define NCMAP_CLASSIC 1
+#define NCMAP_64BIT_OFFSET 2
+#define NCMAP_64BIT_DATA 5
+#define NCMAP_STREAMING 0xFFFFFFFFu
+#define NCMAP_TAG_DIMENSION 0x0A
+#define NCMAP_TAG_VARIABLE 0x0B
+#define NCMAP_TAG_ATTRIBUTE 0x0C
+
+/* Placement of one variable inside the mapped file */
+typedef struct
+{
+    size_t begin;         // Offset of the first element (first record for record vars)
+    size_t count;         // Number of elements of the variable
+    size_t elem_size;     // Size in bytes of one element
+    bool is_record;       // Variable spans the unlimited dimension
+    size_t swapped_start; // Element range [start, end) already byte-swapped in place
+    size_t swapped_end;
+} NcMapVar;
+
+/* Read-only view of a classic NetCDF file mapped with MAP_PRIVATE */
+typedef struct NcMap
+{
+    unsigned char *base; // Start of the mapping
+    size_t size;         // Size of the file/mapping in bytes
+    int version;         // NCMAP_CLASSIC, NCMAP_64BIT_OFFSET or NCMAP_64BIT_DATA
+    int recdim;          // Id of the unlimited dimension (-1 if absent)
+    size_t numrecs;      // Number of records
+    size_t recsize;      // Bytes between two consecutive records
+    NcMapVar *vars;      // One entry per variable (same order as file->var)
+} NcMap;
+
+bool ncmap_open(NetCDF *, const char *);
+void *ncmap_variable_data(NetCDF *, int, size_t, size_t);
+void ncmap_release_variable(NetCDF *, int);
+void ncmap_close(NetCDF *);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef NCWRITER_NETCDF
+#define NCWRITER_NETCDF
+
+#include "structs.h"
+
+/* Reconstructed series output ("<output_dir>/anen-<date>-<pid>.nc") */
+#define NCWRITER_CHUNK 8760 // Default chunk length along time (ds->output_chunk = 0)
+
+/* Reconstructed variable waiting for the writer thread */
+typedef struct NcWriterJob
+{
+    int n; // Index of the variable
+    char name[NC_MAX_NAME + 1];
+    nc_type type;     // Element type of created_data (the variable's type)
+    size_t elem_size; // Bytes per element of created_data
+    void *data;       // created_data, owned (and freed) by the writer
+    double rmse;
+    size_t start; // Range of the prediction period it covers
+    size_t count;
+    struct NcWriterJob *next;
+} NcWriterJob;
+
+typedef struct NcWriter
+{
+    int ncid;
+    int time_dimid;
+    size_t length; // Points of the prediction period
+    size_t chunk;
+    int deflate;   // Compression level (0 = none)
+    int *varids;   // Output variable of each input variable (-1 = not defined yet)
+    NcWriterJob *head;
+    NcWriterJob *tail;
+    bool done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+} NcWriter;
+
+NcWriter *ncwriter_open(NetCDF *, DataSegment *, char *);
+void ncwriter_submit(NcWriter *, NetCDF *, int);
+void ncwriter_submit_range(NcWriter *, NetCDF *, int, size_t, size_t);
+void ncwriter_close(NcWriter *);
+
+#endif
@@ -10,108 +10,187 @@
     };                                                       \
     break;
 
-#define VALIDATE_DATA(TYPE)                                                      \
-    case TYPE:                                                                   \
-    {                                                                            \
-        for (int j = 0; j < file->dim->len; j++)                                 \
-        {                                                                        \
-            if (isnan((double)(((TYPE_VAR_##TYPE *)var->data)[j])))              \
-            {                                                                    \
-                invalid_count++;                                                 \
-                continue;                                                        \
-            }                                                                    \
-            if (((TYPE_VAR_##TYPE *)var->data)[j] == (TYPE_VAR_##TYPE)VALUE_ERR) \
-            {                                                                    \
-                ((TYPE_VAR_##TYPE *)var->data)[j] = (TYPE_VAR_##TYPE)VALUE_NAN;  \
-                invalid_count++;                                                 \
-            }                                                                    \
-        }                                                                        \
-    };                                                                           \
+/* Branch-free, so that the compiler can vectorize it */
+#define VALIDATE_DATA(TYPE)                                              \
+    case TYPE:                                                           \
+    {                                                                    \
+        TYPE_VAR_##TYPE *values = (TYPE_VAR_##TYPE *)var->data;          \
+        for (int j = start; j < end; j++)                                \
+        {                                                                \
+            bool is_err = values[j] == (TYPE_VAR_##TYPE)VALUE_ERR;       \
+            invalid_count += is_err || isnan((double)values[j]);         \
+            values[j] = is_err ? (TYPE_VAR_##TYPE)VALUE_NAN : values[j]; \
+        }                                                                \
+    };                                                                   \
     break;
 
-#define IF_ISNAN(TYPE)                                                  \
-    case TYPE:                                                          \
-    {                                                                   \
-        if (isnan((double)((TYPE_VAR_##TYPE *)var->data)[j]))           \
-        {                                                               \
-            if (!d_time[0] && j > 0)                                    \
-            {                                                           \
-                d_time[0] = ((TYPE_VAR_##TYPE *)var_zero->data)[j - 1]; \
-                d_interp[0] = ((TYPE_VAR_##TYPE *)var->data)[j - 1];    \
-                d_index[0] = j;                                         \
-            }                                                           \
-            count++;                                                    \
-            continue;                                                   \
-        }                                                               \
-        if (d_time[0] && !d_time[1])                                    \
-        {                                                               \
-            if (count > ds->win_size_interpolation)                     \
-            {                                                           \
-                count = 0;                                              \
-                d_time[0] = 0;                                          \
-                d_interp[0] = 0;                                        \
-                d_index[0] = 0;                                         \
-                continue;                                               \
-            };                                                          \
-            d_time[1] = ((TYPE_VAR_##TYPE *)var_zero->data)[j];         \
-            d_interp[1] = ((TYPE_VAR_##TYPE *)var->data)[j];            \
-            d_index[1] = j;                                             \
-        }                                                               \
-    };                                                                  \
+/* Times of n samples of the axis from first, in one pass of its own type */
+#define LOAD_TIMES(TYPE)                                           \
+    case TYPE:                                                     \
+    {                                                              \
+        TYPE_VAR_##TYPE *axis = (TYPE_VAR_##TYPE *)var_zero->data; \
+        for (int l = 0; l < n; l++)                                \
+            times[l] = (double)axis[first + l];                    \
+    };                                                             \
     break;
 
-#define INTERP_DATA(TYPE)                                                   \
-    case TYPE:                                                              \
-    {                                                                       \
-        gsl_interp_init(interp, d_time, d_interp, 2);                       \
-        for (int l = d_index[0]; l <= d_index[1]; l++)                      \
-        {                                                                   \
-            if (isnan((double)((TYPE_VAR_##TYPE *)var->data)[l]))           \
-            {                                                               \
-                ((TYPE_VAR_##TYPE *)var->data)[l] =                         \
-                    gsl_interp_eval(interp,                                 \
-                                    d_time,                                 \
-                                    d_interp,                               \
-                                    ((TYPE_VAR_##TYPE *)var_zero->data)[l], \
-                                    acc);                                   \
-            }                                                               \
-        }                                                                   \
-        d_changes += count;                                                 \
-        count = 0;                                                          \
-        d_time[0] = 0;                                                      \
-        d_time[1] = 0;                                                      \
-        d_interp[0] = 0;                                                    \
-        d_interp[1] = 0;                                                    \
-        d_index[0] = 0;                                                     \
-        d_index[1] = 0;                                                     \
-    };                                                                      \
+/*
+ * Gap-filling kernel, for the types that can hold NaN. Each NaN run
+ * [run_start, j) with a valid sample on both sides, at most
+ * win_size_interpolation long and with its times inside those of the two
+ * neighbours, is filled with the linear ramp between them against the
+ * time axis (the expression of GSL's two-point linear interpolation).
+ * The times of the run are loaded once and checked up front, so the fill
+ * is a plain loop with no branch, which the compiler vectorizes.
+ */
+#define FILL_GAPS(TYPE)                                                                  \
+    case TYPE:                                                                           \
+    {                                                                                    \
+        TYPE_VAR_##TYPE *values = (TYPE_VAR_##TYPE *)var->data;                          \
+        for (int j = start; j < end; j++)                                                \
+        {                                                                                \
+            if (isnan(values[j]))                                                        \
+            {                                                                            \
+                if (!in_run)                                                             \
+                {                                                                        \
+                    in_run = true;                                                       \
+                    run_start = j;                                                       \
+                    has_left = j > 0;                                                    \
+                    left_value = j > 0 ? values[j - 1] : 0;                              \
+                }                                                                        \
+                continue;                                                                \
+            }                                                                            \
+            if (in_run && has_left && j - run_start <= ds->win_size_interpolation)       \
+            {                                                                            \
+                TYPE_VAR_##TYPE *gap = &values[run_start];                               \
+                int n = j - run_start;                                                   \
+                load_times(var_zero, run_start - 1, n + 2, times);                       \
+                double t0 = times[0], t1 = times[n + 1];                                 \
+                double dx = t1 - t0, dy = values[j] - left_value;                        \
+                bool inside = t0 < t1;                                                   \
+                for (int l = 1; l <= n && inside; l++)                                   \
+                    inside = times[l] >= t0 && times[l] <= t1;                           \
+                if (inside)                                                              \
+                {                                                                        \
+                    for (int l = 0; l < n; l++)                                          \
+                        gap[l] = (TYPE_VAR_##TYPE)(left_value + (times[l + 1] - t0) / dx * dy); \
+                    d_filled += n;                                                       \
+                }                                                                        \
+            }                                                                            \
+            in_run = false;                                                              \
+        }                                                                                \
+    };                                                                                   \
     break;
 
-#define COUNT_VALID_WIN(TYPE)                                                        \
-    case TYPE:                                                                       \
-    {                                                                                \
-        for (int j = start; j <= end; j++)                                           \
-        {                                                                            \
-            invalid_count = 0;                                                       \
-            for (int i = 0; i < ds->win_size; i++)                                   \
-                if (isnan((double)(((TYPE_VAR_##TYPE *)var->data)[(j - ds->k) + i]))) \
-                {                                                                    \
-                    invalid_count++;                                                 \
-                    break;                                                           \
-                }                                                                    \
-            if (invalid_count == 0)                                                  \
-                num_isvalid++;                                                       \
-        }                                                                            \
-    };                                                                               \
+/* One pass: run = valid values ending at p, the last of a window */
+#define COUNT_VALID_WIN(TYPE)                                            \
+    case TYPE:                                                           \
+    {                                                                    \
+        TYPE_VAR_##TYPE *values = (TYPE_VAR_##TYPE *)var->data;          \
+        int run = 0;                                                     \
+        for (int p = start - ds->k; p <= end - ds->k + ds->win_size - 1; p++) \
+        {                                                                \
+            run = isnan((double)values[p]) ? 0 : run + 1;                \
+            num_isvalid += p >= start - ds->k + ds->win_size - 1 &&      \
+                           run >= ds->win_size;                          \
+        }                                                                \
+    };                                                                   \
     break;
 
+/* Prefix count of invalid samples in [lo, hi), with the test of validate_window_simple */
+#define PREFIX_INVALID(TYPE, IS_INVALID)                            \
+    case TYPE:                                                      \
+    {                                                               \
+        TYPE_VAR_##TYPE *values = (TYPE_VAR_##TYPE *)var->data;     \
+        for (int p = lo; p < hi; p++)                               \
+            prefix[p - lo + 1] = prefix[p - lo] + (IS_INVALID);     \
+    };                                                              \
+    break;
+
+/* Bit c of var->valid_windows: window centred at c without invalid values */
+static inline bool window_is_valid(const Variable *var, int c)
+{
+    return (var->valid_windows[c >> 6] >> (c & 63)) & 1;
+}
+
+/*
+ * Time value -> index of the time axis (var[0]). A regular axis (constant
+ * step) is answered with one division; an increasing irregular one by a
+ * binary search over the axis itself; anything else by a binary search
+ * over a sorted copy.
+ */
+typedef enum
+{
+    TIME_REGULAR = 0,
+    TIME_INCREASING,
+    TIME_SORTED
+} TimeAxisKind;
+
+typedef struct
+{
+    double time;
+    int index;
+} TimeEntry;
+
+typedef struct TimeIndex
+{
+    TimeAxisKind kind;
+    int len;
+    double first;      // Time of index 0 (TIME_REGULAR)
+    double step;       // Constant step (TIME_REGULAR)
+    TimeEntry *sorted; // Times with their indices, ascending (TIME_SORTED)
+} TimeIndex;
+
+/* Gap interpolation scan, resumable from one range to the next */
+typedef struct
+{
+    bool in_run;       // A NaN run is still open at the end of the scan
+    bool has_left;     // It has a valid sample before it
+    int run_start;     // First NaN of the open run
+    double left_value; // Valid sample before it
+    int d_filled;      // Invalid values actually replaced
+} InterpState;
+
+/*
+ * Chunked prediction (ds->prediction_chunk): a variable stays resident up
+ * to start_prediction; after it, it is loaded, interpolated and dropped
+ * chunk by chunk, carrying the scan state over.
+ */
+typedef struct ChunkStream
+{
+    InterpState interp;
+    bool interpolate; // Gate of interpolation_variable
+    int limit;        // End (exclusive) of the interpolation scan
+    int loaded;       // Loaded up to (exclusive)
+    int scanned;      // Interpolated up to (exclusive)
+    int dropped;      // Memory given back up to (exclusive)
+    int invalid_raw;  // Invalid values of the whole slab before interpolation
+} ChunkStream;
+
 time_t convert_time(char *);
-int binary_search(NetCDF *, int);
+void build_time_index(NetCDF *);
+void release_time_index(NetCDF *);
+int find_time_index(NetCDF *, double);
+double time_value(Variable *, int);
+void set_periods(NetCDF *, DataSegment *);
 void analyze_data(NetCDF *, DataSegment *, process_func);
 void print_data_values(NetCDF *, DataSegment *);
+int count_invalid_range(Variable *, int, int);
+void count_invalid_variable(NetCDF *, DataSegment *, int);
 void count_invalid_values(NetCDF *, DataSegment *);
+int count_valid_window_range(Variable *, DataSegment *, int, int);
+void count_valid_window_variable(NetCDF *, DataSegment *, int);
 void count_valid_window(NetCDF *, DataSegment *);
 void print_info_percentage(NetCDF *, DataSegment *);
+void interpolation_range(NetCDF *, DataSegment *, int, InterpState *, int, int);
+void interpolation_variable(NetCDF *, DataSegment *, int);
 void interpolation_values(NetCDF *, DataSegment *);
+void preprocess_variable(NetCDF *, DataSegment *, int);
+void preprocess_variable_chunked(NetCDF *, DataSegment *, int);
+void preprocess_chunk(NetCDF *, DataSegment *, int, int, int);
+void release_chunk(NetCDF *, DataSegment *, int, int);
+void index_valid_windows(NetCDF *, DataSegment *, int, int, int);
+int collect_valid_windows(NetCDF *, int, int, int, int, int, int *);
+void release_valid_windows(Variable *);
 
 #endif
\ No newline at end of file
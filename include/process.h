@@ -3,37 +3,12 @@
 
 #include "structs.h"
 #include "kdtree.h"
+#include "distance.h"
 
 // =============================================================================
 // MACROS PARA PROCESSAMENTO DE DADOS
 // =============================================================================
 
-#define MONACHE(TYPE)                                                    \
-    case TYPE:                                                           \
-    {                                                                    \
-        for (int x = 0; x < ds->win_size; x++)                           \
-        {                                                                \
-            double diff =                                                \
-                ((TYPE_VAR_##TYPE *)var->data)[(forecast - ds->k) + x] - \
-                ((TYPE_VAR_##TYPE *)var->data)[(analog - ds->k) + x];    \
-            sum += diff * diff;                                          \
-        }                                                                \
-    };                                                                   \
-    break;
-
-#define MONACHESW(TYPE)                                                            \
-    case TYPE:                                                                     \
-    {                                                                              \
-        for (int x = 0; x < ds->win_size; x++)                                     \
-        {                                                                          \
-            double diff =                                                          \
-                ((TYPE_VAR_##TYPE *)file[f].var[i].data)[(forecast - ds->k) + x] - \
-                ((TYPE_VAR_##TYPE *)file[f].var[i].data)[(analog - ds->k) + x];    \
-            sum += diff * diff;                                                    \
-        }                                                                          \
-    };                                                                             \
-    break;
-
 #define ALLOCATE_MEMORY_REC_DATA(TYPE, LENGTH)                                          \
     case TYPE:                                                                          \
         predicted_file->var[n].created_data = malloc(LENGTH * sizeof(TYPE_VAR_##TYPE)); \
@@ -91,6 +66,34 @@
         }                                                                                      \
         break;
 
+#define SERIES_AS_DOUBLE(TYPE)                                \
+    case TYPE:                                                \
+        for (size_t j = 0; j < len; j++)                      \
+            column[j] = (double)((TYPE_VAR_##TYPE *)var->data)[j]; \
+        break;
+
+// Forecasts consecutivos por bloco do motor diagonal (anen_parallel_worker);
+// a soma de cada diagonal é recalculada no início de cada bloco
+#define ANEN_DIAGONAL_BLOCK 512
+
+// Tiles do motor GEMM (anen_gemm_worker): forecasts x analogs por dgemm
+#define ANEN_GEMM_FORECASTS 64
+#define ANEN_GEMM_ANALOGS 512
+// Erro máximo aceito de ||a||² + ||b||² - 2a·b contra a métrica direta,
+// relativo a ||a||² + ||b||²
+#define ANEN_GEMM_TOLERANCE 1e-6
+
+// Folga relativa do limite inferior do motor com poda (anen_pruned_worker):
+// o par só é descartado quando o limite passa do limiar além do arredondamento
+#define ANEN_PRUNE_SLACK 1e-9
+// Analogs válidos consecutivos por envelope (mínimo/máximo por dimensão)
+// do motor com poda; um bloco inteiro é descartado pelo envelope
+#define ANEN_ENVELOPE_BLOCK 64
+
+// ds->window_matrix: matriz no tipo das séries preditoras (NC_FLOAT se
+// todas forem float, NC_DOUBLE caso contrário)
+#define WINDOW_MATRIX_AUTO ((nc_type)-1)
+
 // =============================================================================
 // ESTRUTURAS PARA ALGORITMOS OTIMIZADOS
 // =============================================================================
@@ -122,6 +125,18 @@ typedef struct
     DataSegment *ds;                // Configurações do algoritmo
     int n;                          // Índice da variável sendo processada
     PreFilteredData *filtered_data; // Dados pré-filtrados (read-only)
+    double **series;                // Séries preditoras da variável n em double
+    int num_series;                 // Quantidade de séries preditoras
+    unsigned char *valid;           // valid[t]: forecast ou analog válido em t
+    int dim;                        // Dimensão da super janela (séries x win_size)
+    double *forecast_windows;       // Super janelas dos forecasts válidos (GEMM)
+    double *analog_windows;         // Super janelas dos analogs válidos (GEMM)
+    double *forecast_norms;         // ||a||² de cada linha de forecast_windows
+    double *analog_norms;           // ||b||² de cada linha de analog_windows
+    double *forecast_moments;       // Média e norma centrada por série dos forecasts válidos (poda)
+    double *analog_moments;         // Média e norma centrada por série dos analogs válidos (poda)
+    int num_blocks;                 // Blocos de ANEN_ENVELOPE_BLOCK analogs válidos (poda)
+    double *envelopes;              // Mínimos e máximos de janelas e momentos por bloco (poda)
 } ANENSharedData;
 
 /**
@@ -137,7 +152,12 @@ typedef struct
     int start_forecast_idx; // Índice inicial no array valid_forecasts
     int end_forecast_idx;   // Índice final no array valid_forecasts
     int processed_count;    // Contador local de forecasts processados
+    double reconstruct_time; // Tempo gasto na reconstrução
     double processing_time; // Tempo de processamento desta thread
+    double max_error;       // Maior erro relativo do GEMM contra a métrica direta
+    long long pruned_count; // Pares descartados pelo limite inferior (poda)
+    long long abandoned_count; // Pares com a soma interrompida no limiar (poda)
+    long long envelope_count; // Pares descartados com o envelope do bloco (poda)
 } ANENWorkerData;
 
 // =============================================================================
@@ -174,6 +194,7 @@ typedef struct
     int start_forecast_idx;   // Índice inicial no array valid_forecasts
     int end_forecast_idx;     // Índice final no array valid_forecasts
     int processed_count;      // Contador local de forecasts processados
+    double reconstruct_time;  // Tempo gasto na reconstrução
     double processing_time;   // Tempo de processamento desta thread
 } KDANENWorkerData;
 
@@ -189,7 +210,8 @@ typedef struct
  * pré-computação sequencial dos índices válidos.
  *
  * Características:
- * - Complexidade: O(n×m/t) onde n=forecasts, m=analogs, t=threads
+ * - Complexidade: O(n×m×s/t) onde n=forecasts, m=analogs, s=séries
+ *   preditoras, t=threads (recorrência diagonal: independe da janela)
  * - Speedup típico: 3-4x com 4-8 threads
  * - Overhead: ~5% para pré-filtro
  * - Ideal para: datasets médios/grandes com boa distribuição de dados válidos
@@ -199,6 +221,39 @@ typedef struct
  */
 void anen_dependent_parallel(NetCDF *file, DataSegment *ds);
 
+/**
+ * @brief Algoritmo ANEN Paralelo por blocos GEMM
+ *
+ * Alternativa a anen_dependent_parallel: as super janelas dos forecasts
+ * e dos analogs válidos formam matrizes, e cada tile de distâncias vem
+ * de ||a - b||² = ||a||² + ||b||² - 2a·b, com a·b por gsl_blas_dgemm e
+ * as normas pré-calculadas. O top-k é feito sobre cada tile de
+ * resultado. Os vizinhos escolhidos de uma amostra de forecasts são
+ * conferidos com a métrica direta (ANEN_GEMM_TOLERANCE).
+ *
+ * @param file Array de arquivos NetCDF [predicted, predictor]
+ * @param ds Configurações do algoritmo (períodos, janelas, threads)
+ */
+void anen_dependent_parallel_gemm(NetCDF *file, DataSegment *ds);
+
+/**
+ * @brief Algoritmo ANEN Paralelo com poda por limite inferior
+ *
+ * Alternativa a anen_dependent_parallel: busca par a par que mantém o
+ * k-ésimo melhor candidato de cada forecast como limiar. Blocos de
+ * ANEN_ENVELOPE_BLOCK analogs consecutivos cujo envelope (mínimo e máximo
+ * de cada dimensão) fica além do limiar são descartados inteiros; nos
+ * demais, analogs cujo limite inferior (média e norma centrada da janela
+ * de cada série) passa do limiar são descartados sem ler as janelas, e a
+ * soma das demais é interrompida ao alcançá-lo. O resultado é o mesmo da
+ * busca completa; o total de pares evitados por variável é informado em
+ * stderr. Dispensa a KD-Tree quando win_size x séries é alto.
+ *
+ * @param file Array de arquivos NetCDF [predicted, predictor]
+ * @param ds Configurações do algoritmo (períodos, janelas, threads)
+ */
+void anen_dependent_parallel_pruned(NetCDF *file, DataSegment *ds);
+
 /**
  * @brief Algoritmo KD-ANEN Paralelo - KD-Tree + Analog Ensemble
  *
@@ -246,13 +301,37 @@ void free_prefiltered_data(PreFilteredData *filtered);
  * @brief Worker thread para processamento ANEN
  *
  * Função executada por cada thread no algoritmo ANEN paralelo.
- * Processa uma faixa de forecasts usando dados pré-filtrados.
+ * Processa uma faixa de forecasts usando dados pré-filtrados, com as
+ * distâncias de cada diagonal forecast–analog atualizadas em O(s).
  *
  * @param arg Ponteiro para ANENWorkerData
  * @return NULL
  */
 void *anen_parallel_worker(void *arg);
 
+/**
+ * @brief Worker thread para processamento ANEN por blocos GEMM
+ *
+ * Processa uma faixa de forecasts em tiles de ANEN_GEMM_FORECASTS x
+ * ANEN_GEMM_ANALOGS distâncias.
+ *
+ * @param arg Ponteiro para ANENWorkerData
+ * @return NULL
+ */
+void *anen_gemm_worker(void *arg);
+
+/**
+ * @brief Worker thread para processamento ANEN com poda
+ *
+ * Processa uma faixa de forecasts par a par, descartando blocos de
+ * analogs pelo envelope, analogs pelo limite inferior dos momentos e
+ * interrompendo somas acima do limiar.
+ *
+ * @param arg Ponteiro para ANENWorkerData
+ * @return NULL
+ */
+void *anen_pruned_worker(void *arg);
+
 // =============================================================================
 // FUNÇÕES AUXILIARES GERAIS
 // =============================================================================
@@ -284,6 +363,40 @@ bool validate_window_simple(Variable *var, int position, int k,
  */
 void processing_data(NetCDF *file, DataSegment *ds, process_func func);
 
+/**
+ * @brief Carrega e pré-processa a variável n sob demanda
+ *
+ * Com ds->lazy_load, materializa a variável n do arquivo predito e,
+ * se ela for selecionada para reconstrução, das séries preditoras.
+ *
+ * @param file Array de arquivos NetCDF
+ * @param ds Configurações do algoritmo
+ * @param n Índice da variável
+ */
+void acquire_processing_variable(NetCDF *file, DataSegment *ds, int n);
+
+/**
+ * @brief Libera a variável n de todos os arquivos
+ *
+ * Chamada após a reconstrução e o RMSE da variável: envia created_data
+ * ao ds->writer, se houver, e libera os dados (apenas com ds->lazy_load).
+ *
+ * @param file Array de arquivos NetCDF
+ * @param ds Configurações do algoritmo
+ * @param n Índice da variável
+ */
+void release_processing_variable(NetCDF *file, DataSegment *ds, int n);
+
+/**
+ * @brief Aguarda o pré-carregamento em andamento (ds->prefetch)
+ *
+ * Chamada por processing_data ao final do algoritmo, para que nenhuma
+ * thread continue lendo os arquivos depois da liberação.
+ *
+ * @param ds Configurações do algoritmo
+ */
+void wait_prefetch_variable(DataSegment *ds);
+
 /**
  * @brief Cálculo da métrica de distância Monache
  *
@@ -303,7 +416,7 @@ double monache_metric(Variable *var, DataSegment *ds, int forecast, int analog,
  *
  * Versão estendida que considera múltiplas séries temporais.
  *
- * @param file Array de arquivos NetCDF
+ * @param file Primeiro preditor (&file[1]); soma ds->argc - 1 séries
  * @param ds Configurações do algoritmo
  * @param forecast Posição do forecast
  * @param analog Posição do analog
@@ -352,6 +465,20 @@ void recreate_data_fixed(NetCDF *file, DataSegment *ds, ClosestPoint *closest,
  */
 void calculate_rmse_fixed(NetCDF *file, DataSegment *ds, int n);
 
+/**
+ * @brief Acumula soma dos erros quadráticos e contagem do RMSE
+ *
+ * Usada pela predição em blocos: cada bloco soma seus termos, e o RMSE
+ * é sqrt(sum / total) ao final.
+ *
+ * @param file Arquivo NetCDF
+ * @param ds Configurações do algoritmo (período do bloco)
+ * @param n Índice da variável
+ * @param sum Soma dos erros quadráticos (acumulada)
+ * @param total Pares válidos (acumulado)
+ */
+void accumulate_rmse(NetCDF *file, DataSegment *ds, int n, double *sum, int *total);
+
 /**
  * @brief Aloca array de pontos próximos com inicialização segura
  *
@@ -421,18 +548,82 @@ typedef struct KDTreeMultiSeries
 {
     unsigned int window_id;
     int total_dimensions;
+    int row; // Linha em ds->windows (-1 sem matriz de super janelas)
     struct KDTreeMultiSeries *left;
     struct KDTreeMultiSeries *right;
 } KDTreeMultiSeries;
 
 /**
  * @brief Pool de nós para KD-Tree de múltiplas séries
+ *
+ * Arena (kdtree.h) reservada com o número de janelas válidas do treino
+ * antes de cada construção: os nós ficam contíguos, sem malloc por nó.
  */
-typedef struct
+typedef NodeArena MultiSeriesNodePool;
+
+/**
+ * @brief Matriz de super janelas do treino (ds->window_matrix)
+ *
+ * Uma linha alinhada (STORE_ALIGNMENT) por analog válido, com as janelas
+ * de todas as séries preditoras contíguas, em ordem sequencial (série a
+ * série, como get_multiseries_value) ou entrelaçada (posição a posição,
+ * como get_multiseries_value_interleaved). A árvore é construída sobre
+ * as linhas e a busca lê só a matriz e a super janela do forecast.
+ * Ocupa cerca de win_size vezes as séries preditoras. Com NC_SHORT, os
+ * valores são quantizados em int16 (valor = q x scale + offset, com a
+ * mesma escala para todas as séries da variável, o que mantém as
+ * distâncias na unidade original) e os candidatos são re-ranqueados com
+ * a distância exata (ds->window_overfetch).
+ */
+typedef struct SuperWindowMatrix
+{
+    nc_type type;     // NC_FLOAT, NC_DOUBLE ou NC_SHORT (quantizado)
+    bool interleaved; // Ordem das dimensões na linha
+    double scale;     // NC_SHORT: passo de quantização
+    double offset;    // NC_SHORT: valor de q = 0
+    int rows;         // Analogs válidos
+    int dim;          // Séries preditoras x win_size
+    size_t stride;    // Elementos por linha, com preenchimento de alinhamento
+    int *window_ids;  // Janela (índice de tempo) de cada linha
+    void *data;       // rows x stride
+} SuperWindowMatrix;
+
+/* Bytes por valor da matriz */
+static inline size_t window_matrix_size(const SuperWindowMatrix *m)
+{
+    return m->type == NC_DOUBLE ? sizeof(double) : m->type == NC_SHORT ? sizeof(short) : sizeof(float);
+}
+
+/* Valor da dimensão d de uma super janela no layout da matriz (na unidade original) */
+static inline double window_matrix_value(const SuperWindowMatrix *m, const void *window, int d)
+{
+    switch (m->type)
+    {
+    case NC_DOUBLE:
+        return ((const double *)window)[d];
+    case NC_SHORT:
+        return ((const short *)window)[d] * m->scale + m->offset;
+    default:
+        return (double)((const float *)window)[d];
+    }
+}
+
+/* Linha r da matriz */
+static inline const void *window_matrix_row(const SuperWindowMatrix *m, int r)
 {
-    KDTreeMultiSeries nodes[NODE_POOL_SIZE];
-    int next_available;
-} MultiSeriesNodePool;
+    return (const char *)m->data + (size_t)r * m->stride * window_matrix_size(m);
+}
+
+#define WINDOW_VALUE(TYPE) \
+    case TYPE:             \
+        return (double)((TYPE_VAR_##TYPE *)var->data)[position];
+
+SuperWindowMatrix *build_window_matrix(NetCDF *file, DataSegment *ds, int n, const int *window_ids,
+                                       int count, bool interleaved);
+void free_window_matrix(SuperWindowMatrix *m);
+void *alloc_super_window(const SuperWindowMatrix *m);
+void fill_super_window(const SuperWindowMatrix *m, NetCDF *file, DataSegment *ds, int n, int window_id, void *out);
+double window_matrix_sqdist(const SuperWindowMatrix *m, const void *target, int row);
 
 /**
  * @brief Dados compartilhados para threads no algoritmo KD-ANEN dependent
@@ -8,14 +8,42 @@
         data = malloc(LENGTH * sizeof(TYPE_VAR_##TYPE)); \
         break;
 
+#define TYPE_SIZE(TYPE) \
+    case TYPE:          \
+        return sizeof(TYPE_VAR_##TYPE);
+
+/* Alignment of the normalized (store_type) columns */
+#define STORE_ALIGNMENT 64
+
+#define NORMALIZE_DATA(TYPE, STORE)                                         \
+    case TYPE:                                                              \
+        for (size_t j = 0; j < len; j++)                                    \
+            ((STORE *)data)[j] = (STORE)((TYPE_VAR_##TYPE *)var->data)[j]; \
+        break;
+
+/* Serializes every libnetcdf call made off the main thread */
+extern pthread_mutex_t netcdf_lock;
+
 void handle_error(int);
 NetCDF *create_struct(DataSegment *, char *[]);
 void *allocate_memory(char, size_t);
+size_t data_type_size(nc_type);
 void deallocate_memory(NetCDF *, int);
 void read_dimensions(NetCDF *);
 void read_variables(NetCDF *);
 void read_header_file(NetCDF *, DataSegment *);
+void read_variable(NetCDF *, int, size_t, size_t);
+void normalize_variable(NetCDF *, int, size_t);
+void reserve_variable(NetCDF *, int);
+void read_variable_range(NetCDF *, int, size_t, size_t);
+size_t drop_variable_range(NetCDF *, int, size_t, size_t);
 void read_data_file(NetCDF *, DataSegment *);
+void parallel_file_variables(NetCDF *, DataSegment *, int, int, int, int, variable_func, int);
+void parallel_variables(NetCDF *, DataSegment *, variable_func, int);
+void ingest_variables(NetCDF *, DataSegment *);
+void *acquire_variable(NetCDF *, int);
+void release_variable(NetCDF *, int);
+void select_slab(NetCDF *, DataSegment *);
 void write_file(NetCDF *, char *);
 
 #endif
\ No newline at end of file
@@ -7,10 +7,10 @@
 #include <sys/time.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <pthread.h>
 
 #include <netcdf.h>
-#include <gsl/gsl_interp.h>
 
 #define TYPE_VAR_NC_BYTE signed char
 #define TYPE_VAR_NC_CHAR char
@@ -49,6 +49,14 @@ typedef struct
     size_t len;
 } Dimension;
 
+/* Owner of the memory pointed to by Variable.data */
+typedef enum
+{
+    DATA_HEAP = 0, // malloc'ed, released by deallocate_memory
+    DATA_MAPPED,   // Points into the file mapping (see ncmmap.h)
+    DATA_RESERVED  // Anonymous mapping of the whole slab, filled by ranges (chunked prediction)
+} DataStorage;
+
 typedef struct
 {
     char name[NC_MAX_NAME + 1];
@@ -62,8 +70,13 @@ typedef struct
     double rmse;
     double bias;
     void *num_valid_window;
+    uint64_t *valid_windows;   // Validity index, one bit per window centre (see index_valid_windows)
     void *data;
     void *created_data;
+    DataStorage storage;
+    bool ready;                // Already preprocessed (lazy loading, cache)
+    nc_type file_type;         // Type in the source file (DATA_RESERVED)
+    struct ChunkStream *stream; // Chunked prediction state (see preprocess.h)
 } Variable;
 
 typedef struct
@@ -73,6 +86,11 @@ typedef struct
     int nvars;
     Dimension *dim;
     Variable *var;
+    size_t offset;     // Index in the file of data[0] (slab reading)
+    struct NcMap *map; // Non-NULL when the file was loaded through mmap
+    struct NcCache *cache; // Non-NULL when loaded from a preprocessed image (nccache.h)
+    nc_type store_type;    // Type the data variables are normalized to (0 = as in the file)
+    struct TimeIndex *time_index; // Lookup of the time axis var[0] (see preprocess.h)
 } NetCDF;
 /* End - NetCDF data structure */
 
@@ -84,6 +102,10 @@ typedef struct
     int end_prediction;
     int start_training;
     int end_training;
+    time_t time_start_prediction; // Period bounds in minutes (see convert_time)
+    time_t time_end_prediction;
+    time_t time_start_training;
+    time_t time_end_training;
     int k;
     int win_size;
     int win_size_interpolation;
@@ -93,11 +115,33 @@ typedef struct
     int indice_generic;
     int win_count;
     float current_best_distance;
+    bool use_mmap;
+    bool read_slab;
+    bool lazy_load;
+    bool load_all;      // Read and preprocess every variable in create_struct
+    int num_io_thread;  // Ingestion threads (0 = one per CPU)
+    bool prefetch;      // Lazy load: acquire variable n+1 while n is processed
+    bool prefetching;   // prefetch_thread is running (see wait_prefetch_variable)
+    int prediction_chunk; // Points per chunk of the prediction period (0 = whole period)
+    char *output_dir;   // Reconstructed series output (NULL = not written)
+    int output_chunk;   // Chunk length along time (0 = NCWRITER_CHUNK)
+    int output_deflate; // Compression level, 0-9
+    struct NcWriter *writer;
+    pthread_t prefetch_thread;
+    nc_type store_type; // NC_FLOAT/NC_DOUBLE: normalize every data variable at load time
+    nc_type window_matrix; // NC_FLOAT/NC_DOUBLE/NC_SHORT (int16)/WINDOW_MATRIX_AUTO (series type): multi-series KD search over a training super-window matrix (0 = off)
+    int window_overfetch;  // NC_SHORT matrix: candidates fetched per neighbour, re-ranked with exact distances
+    struct SuperWindowMatrix *windows; // Matrix of the variable being processed (see window_matrix)
+    void *target_window;   // Super window of the forecast being searched (per thread, matrix layout)
+    bool use_cache;
+    bool use_shm;
+    char *cache_dir;
     NetCDF *predicted_file;
     NetCDF *predictor_file;
 } DataSegment;
 
 typedef void (*process_func)(NetCDF *, DataSegment *);
+typedef void (*variable_func)(NetCDF *, DataSegment *, int); // Variable i of one file (ds->indice_generic)
 
 /* End - Data Segment structure */
 
@@ -0,0 +1,69 @@
+#ifndef TOPK_NETCDF
+#define TOPK_NETCDF
+
+#include "structs.h"
+
+/*
+ * Bounded selection of the num_Na nearest analogs, shared by every search
+ * path. The candidates form a max-heap over ClosestPoint with the farthest
+ * at [0], so once the heap is full closest[0].distance is the k-th best
+ * distance, the threshold a new candidate must beat. An insertion costs
+ * O(log num_Na) instead of a sort of the whole array. The heap is not
+ * ordered beyond [0]; recreate_data only needs the set.
+ */
+
+/* Candidates per pass of the batch threshold filter */
+#define TOPK_BATCH 256
+
+/* Distance a candidate must be below to enter: the worst kept once full */
+static inline double topk_threshold(const ClosestPoint *closest, int found, int capacity)
+{
+    return found < capacity ? INFINITY : closest[0].distance;
+}
+
+/*
+ * Inserts a candidate: appended while the heap is not full (the caller
+ * filters NaN), otherwise it replaces the worst if strictly closer.
+ * Returns whether the candidate was kept.
+ */
+static inline bool topk_push(ClosestPoint *closest, int *found, int capacity,
+                             unsigned int window_index, double distance)
+{
+    int i;
+
+    if (*found < capacity)
+    {
+        /* Sift up from the new leaf */
+        for (i = (*found)++; i > 0 && closest[(i - 1) / 2].distance < distance; i = (i - 1) / 2)
+            closest[i] = closest[(i - 1) / 2];
+    }
+    else
+    {
+        if (!(distance < closest[0].distance))
+            return false;
+
+        /* Sift down from the root */
+        for (i = 0;;)
+        {
+            int child = 2 * i + 1;
+
+            if (child >= capacity)
+                break;
+            if (child + 1 < capacity && closest[child + 1].distance > closest[child].distance)
+                child++;
+            if (!(closest[child].distance > distance))
+                break;
+
+            closest[i] = closest[child];
+            i = child;
+        }
+    }
+
+    closest[i].window_index = window_index;
+    closest[i].distance = distance;
+    return true;
+}
+
+int topk_push_batch(ClosestPoint *, int *, int, const int *, const double *, int);
+
+#endif
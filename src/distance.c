@@ -0,0 +1,396 @@
+#include <immintrin.h>
+
+#include "distance.h"
+
+/*
+ * Window distances of every search path (exhaustive, KD-tree, super
+ * window) end up here. The AVX2 and AVX-512 kernels are compiled with
+ * target attributes, so the binary runs anywhere and distance_init
+ * selects them through cpuid; the scalar kernels are the fallback and
+ * the default before distance_init. Tails (the default window is 11
+ * values) are handled with masked loads, whose masked lanes read as 0.
+ */
+
+static inline __attribute__((always_inline)) double sqdist_float_scalar_n(const float *x, const float *y, int n)
+{
+    double sum = 0.0;
+
+    for (int j = 0; j < n; j++)
+    {
+        double diff = x[j] - y[j];
+        sum += diff * diff;
+    }
+
+    return sum;
+}
+
+static inline __attribute__((always_inline)) double sqdist_double_scalar_n(const double *x, const double *y, int n)
+{
+    double sum = 0.0;
+
+    for (int j = 0; j < n; j++)
+    {
+        double diff = x[j] - y[j];
+        sum += diff * diff;
+    }
+
+    return sum;
+}
+
+static inline __attribute__((always_inline)) double
+sqdist_double_scalar_limit_n(const double *x, const double *y, int n, double limit)
+{
+    double sum = 0.0;
+
+    for (int j = 0; j < n; j += 4)
+    {
+        int end = n - j >= 4 ? j + 4 : n;
+
+        for (int l = j; l < end; l++)
+        {
+            double diff = x[l] - y[l];
+            sum += diff * diff;
+        }
+        if (sum >= limit)
+            break;
+    }
+
+    return sum;
+}
+
+__attribute__((target("avx2"))) static inline double reduce_avx2(__m256d acc)
+{
+    __m128d half = _mm_add_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+
+    return _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+}
+
+__attribute__((target("avx2"))) static inline __attribute__((always_inline)) double
+sqdist_float_avx2_n(const float *x, const float *y, int n)
+{
+    __m256d acc_lo = _mm256_setzero_pd();
+    __m256d acc_hi = _mm256_setzero_pd();
+    int j = 0;
+
+    for (; j < n; j += 8)
+    {
+        __m256 dx;
+
+        if (n - j >= 8)
+            dx = _mm256_sub_ps(_mm256_loadu_ps(x + j), _mm256_loadu_ps(y + j));
+        else
+        {
+            __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(n - j),
+                                              _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+            dx = _mm256_sub_ps(_mm256_maskload_ps(x + j, mask), _mm256_maskload_ps(y + j, mask));
+        }
+
+        __m256d lo = _mm256_cvtps_pd(_mm256_castps256_ps128(dx));
+        __m256d hi = _mm256_cvtps_pd(_mm256_extractf128_ps(dx, 1));
+        acc_lo = _mm256_add_pd(acc_lo, _mm256_mul_pd(lo, lo));
+        acc_hi = _mm256_add_pd(acc_hi, _mm256_mul_pd(hi, hi));
+    }
+
+    return reduce_avx2(_mm256_add_pd(acc_lo, acc_hi));
+}
+
+__attribute__((target("avx2"))) static inline __attribute__((always_inline)) double
+sqdist_double_avx2_n(const double *x, const double *y, int n)
+{
+    __m256d acc = _mm256_setzero_pd();
+
+    for (int j = 0; j < n; j += 4)
+    {
+        __m256d dx;
+
+        if (n - j >= 4)
+            dx = _mm256_sub_pd(_mm256_loadu_pd(x + j), _mm256_loadu_pd(y + j));
+        else
+        {
+            __m256i mask = _mm256_cmpgt_epi64(_mm256_set1_epi64x(n - j),
+                                              _mm256_setr_epi64x(0, 1, 2, 3));
+            dx = _mm256_sub_pd(_mm256_maskload_pd(x + j, mask), _mm256_maskload_pd(y + j, mask));
+        }
+
+        acc = _mm256_add_pd(acc, _mm256_mul_pd(dx, dx));
+    }
+
+    return reduce_avx2(acc);
+}
+
+/* The partial sum is reduced for the test only: acc keeps the order of sqdist_double_avx2_n */
+__attribute__((target("avx2"))) static inline __attribute__((always_inline)) double
+sqdist_double_avx2_limit_n(const double *x, const double *y, int n, double limit)
+{
+    __m256d acc = _mm256_setzero_pd();
+
+    for (int j = 0; j < n; j += 4)
+    {
+        __m256d dx;
+
+        if (n - j >= 4)
+            dx = _mm256_sub_pd(_mm256_loadu_pd(x + j), _mm256_loadu_pd(y + j));
+        else
+        {
+            __m256i mask = _mm256_cmpgt_epi64(_mm256_set1_epi64x(n - j),
+                                              _mm256_setr_epi64x(0, 1, 2, 3));
+            dx = _mm256_sub_pd(_mm256_maskload_pd(x + j, mask), _mm256_maskload_pd(y + j, mask));
+        }
+
+        acc = _mm256_add_pd(acc, _mm256_mul_pd(dx, dx));
+
+        double partial = reduce_avx2(acc);
+        if (partial >= limit)
+            return partial;
+    }
+
+    return reduce_avx2(acc);
+}
+
+__attribute__((target("avx512f"))) static inline __attribute__((always_inline)) double
+sqdist_float_avx512_n(const float *x, const float *y, int n)
+{
+    __m512d acc_lo = _mm512_setzero_pd();
+    __m512d acc_hi = _mm512_setzero_pd();
+
+    for (int j = 0; j < n; j += 16)
+    {
+        __mmask16 mask = n - j >= 16 ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - j)) - 1);
+        __m512 dx = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, x + j), _mm512_maskz_loadu_ps(mask, y + j));
+
+        __m512d lo = _mm512_cvtps_pd(_mm512_castps512_ps256(dx));
+        __m512d hi = _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(dx), 1)));
+        acc_lo = _mm512_add_pd(acc_lo, _mm512_mul_pd(lo, lo));
+        acc_hi = _mm512_add_pd(acc_hi, _mm512_mul_pd(hi, hi));
+    }
+
+    return _mm512_reduce_add_pd(_mm512_add_pd(acc_lo, acc_hi));
+}
+
+__attribute__((target("avx512f"))) static inline __attribute__((always_inline)) double
+sqdist_double_avx512_n(const double *x, const double *y, int n)
+{
+    __m512d acc = _mm512_setzero_pd();
+
+    for (int j = 0; j < n; j += 8)
+    {
+        __mmask8 mask = n - j >= 8 ? (__mmask8)0xFF : (__mmask8)((1u << (n - j)) - 1);
+        __m512d dx = _mm512_sub_pd(_mm512_maskz_loadu_pd(mask, x + j), _mm512_maskz_loadu_pd(mask, y + j));
+
+        acc = _mm512_add_pd(acc, _mm512_mul_pd(dx, dx));
+    }
+
+    return _mm512_reduce_add_pd(acc);
+}
+
+__attribute__((target("avx512f"))) static inline __attribute__((always_inline)) double
+sqdist_double_avx512_limit_n(const double *x, const double *y, int n, double limit)
+{
+    __m512d acc = _mm512_setzero_pd();
+
+    for (int j = 0; j < n; j += 8)
+    {
+        __mmask8 mask = n - j >= 8 ? (__mmask8)0xFF : (__mmask8)((1u << (n - j)) - 1);
+        __m512d dx = _mm512_sub_pd(_mm512_maskz_loadu_pd(mask, x + j), _mm512_maskz_loadu_pd(mask, y + j));
+
+        acc = _mm512_add_pd(acc, _mm512_mul_pd(dx, dx));
+
+        double partial = _mm512_reduce_add_pd(acc);
+        if (partial >= limit)
+            return partial;
+    }
+
+    return _mm512_reduce_add_pd(acc);
+}
+
+/*
+ * Instances of the kernels above: any n, each window size of
+ * SQDIST_WIN_SIZES (n is a constant, so the loops and the tail masks
+ * fold away) and each (series, window size) pair of the super window,
+ * with the series loop unrolled as well.
+ */
+#define KERNELS_ANY(ISA, TARGET)                                                         \
+    TARGET static double sqdist_float_##ISA(const float *x, const float *y, int n)       \
+    {                                                                                    \
+        return sqdist_float_##ISA##_n(x, y, n);                                          \
+    }                                                                                    \
+    TARGET static double sqdist_double_##ISA(const double *x, const double *y, int n)    \
+    {                                                                                    \
+        return sqdist_double_##ISA##_n(x, y, n);                                         \
+    }                                                                                    \
+    TARGET static double sqdist_double_limit_##ISA(const double *x, const double *y,     \
+                                                   int n, double limit)                  \
+    {                                                                                    \
+        return sqdist_double_##ISA##_limit_n(x, y, n, limit);                            \
+    }
+
+#define KERNELS_FIXED(ISA, TARGET, W)                                                          \
+    TARGET static double sqdist_float_##ISA##_##W(const float *x, const float *y, int n)       \
+    {                                                                                          \
+        (void)n;                                                                               \
+        return sqdist_float_##ISA##_n(x, y, W);                                                \
+    }                                                                                          \
+    TARGET static double sqdist_double_##ISA##_##W(const double *x, const double *y, int n)    \
+    {                                                                                          \
+        (void)n;                                                                               \
+        return sqdist_double_##ISA##_n(x, y, W);                                               \
+    }
+
+#define KERNELS_SERIES(ISA, TARGET, S, W)                                                           \
+    TARGET static double sqdist_series_float_##ISA##_##S##_##W(const void *const *cols, int a, int b)  \
+    {                                                                                               \
+        double sum = 0.0;                                                                           \
+        for (int s = 0; s < S; s++)                                                                 \
+            sum += sqdist_float_##ISA##_n((const float *)cols[s] + a, (const float *)cols[s] + b, W);  \
+        return sum;                                                                                 \
+    }                                                                                               \
+    TARGET static double sqdist_series_double_##ISA##_##S##_##W(const void *const *cols, int a, int b) \
+    {                                                                                               \
+        double sum = 0.0;                                                                           \
+        for (int s = 0; s < S; s++)                                                                 \
+            sum += sqdist_double_##ISA##_n((const double *)cols[s] + a, (const double *)cols[s] + b, W); \
+        return sum;                                                                                 \
+    }
+
+#define FIXED_ENTRY(ISA, TARGET, W) [W] = sqdist_float_##ISA##_##W,
+#define FIXED_ENTRY_DOUBLE(ISA, TARGET, W) [W] = sqdist_double_##ISA##_##W,
+#define SERIES_ENTRY(ISA, TARGET, S, W) [S][W] = sqdist_series_float_##ISA##_##S##_##W,
+#define SERIES_ENTRY_DOUBLE(ISA, TARGET, S, W) [S][W] = sqdist_series_double_##ISA##_##S##_##W,
+
+#define FOR_SIZES(M, ISA, TARGET) SQDIST_WIN_SIZES(M, ISA, TARGET)
+#define FOR_SERIES_W(M, ISA, TARGET, W) \
+    M(ISA, TARGET, 1, W) M(ISA, TARGET, 2, W) M(ISA, TARGET, 3, W) M(ISA, TARGET, 4, W) \
+    M(ISA, TARGET, 5, W) M(ISA, TARGET, 6, W) M(ISA, TARGET, 7, W) M(ISA, TARGET, 8, W)
+#define SERIES_OF(ISA, TARGET, W) FOR_SERIES_W(KERNELS_SERIES, ISA, TARGET, W)
+#define SERIES_ROW(ISA, TARGET, W) FOR_SERIES_W(SERIES_ENTRY, ISA, TARGET, W)
+#define SERIES_ROW_DOUBLE(ISA, TARGET, W) FOR_SERIES_W(SERIES_ENTRY_DOUBLE, ISA, TARGET, W)
+
+/* Every kernel and dispatch table of one instruction set */
+#define KERNEL_SET(ISA, TARGET)                                                            \
+    KERNELS_ANY(ISA, TARGET)                                                               \
+    FOR_SIZES(KERNELS_FIXED, ISA, TARGET)                                                  \
+    FOR_SIZES(SERIES_OF, ISA, TARGET)                                                      \
+    static const DistanceKernels kernels_##ISA = {                                         \
+        #ISA,                                                                              \
+        sqdist_float_##ISA,                                                                \
+        sqdist_double_##ISA,                                                               \
+        sqdist_double_limit_##ISA,                                                         \
+        {FOR_SIZES(FIXED_ENTRY, ISA, TARGET)},                                             \
+        {FOR_SIZES(FIXED_ENTRY_DOUBLE, ISA, TARGET)},                                      \
+        {FOR_SIZES(SERIES_ROW, ISA, TARGET)},                                              \
+        {FOR_SIZES(SERIES_ROW_DOUBLE, ISA, TARGET)}};
+
+#define NO_TARGET
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+
+KERNEL_SET(scalar, NO_TARGET)
+KERNEL_SET(avx2, TARGET_AVX2)
+KERNEL_SET(avx512, TARGET_AVX512)
+
+static const DistanceKernels *kernels = &kernels_scalar;
+
+sqdist_float_func sqdist_float = sqdist_float_scalar;
+sqdist_double_func sqdist_double = sqdist_double_scalar;
+sqdist_double_limit_func sqdist_double_limit = sqdist_double_limit_scalar;
+
+/* Pick the kernels once, before any search thread starts */
+void distance_init(void)
+{
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f"))
+        kernels = &kernels_avx512;
+    else if (__builtin_cpu_supports("avx2"))
+        kernels = &kernels_avx2;
+
+    sqdist_float = kernels->window_float;
+    sqdist_double = kernels->window_double;
+    sqdist_double_limit = kernels->window_double_limit;
+}
+
+const char *distance_isa(void)
+{
+    return kernels->isa;
+}
+
+double sqdist_short(const short *x, const short *y, int n)
+{
+    double sum = 0.0;
+
+    for (int j = 0; j < n; j++)
+    {
+        double diff = (int)x[j] - (int)y[j];
+        sum += diff * diff;
+    }
+
+    return sum;
+}
+
+/* Squared distance of the windows of n values starting at a and b */
+double window_sqdist(const Variable *var, int a, int b, int n)
+{
+    double sum = 0.0;
+
+    switch (var->type)
+    {
+    case NC_FLOAT:
+    {
+        sqdist_float_func kernel = n <= SQDIST_MAX_WIN ? kernels->fixed_float[n] : NULL;
+
+        return (kernel ? kernel : sqdist_float)((const float *)var->data + a, (const float *)var->data + b, n);
+    }
+    case NC_DOUBLE:
+    {
+        sqdist_double_func kernel = n <= SQDIST_MAX_WIN ? kernels->fixed_double[n] : NULL;
+
+        return (kernel ? kernel : sqdist_double)((const double *)var->data + a, (const double *)var->data + b, n);
+    }
+        SQDIST_WINDOW(NC_BYTE);
+        SQDIST_WINDOW(NC_CHAR);
+        SQDIST_WINDOW(NC_SHORT);
+        SQDIST_WINDOW(NC_INT);
+        SQDIST_WINDOW(NC_UBYTE);
+        SQDIST_WINDOW(NC_USHORT);
+        SQDIST_WINDOW(NC_UINT);
+        SQDIST_WINDOW(NC_INT64);
+        SQDIST_WINDOW(NC_UINT64);
+    }
+
+    return sum;
+}
+
+/*
+ * Sum of window_sqdist over variable i of file[first..last): one call of
+ * the unrolled super-window kernel when every series has the store type
+ * and (series, n) has an instance, a loop over the series otherwise.
+ */
+double series_sqdist(NetCDF *file, int first, int last, int i, int a, int b, int n)
+{
+    int series = last - first;
+    double sum = 0.0;
+
+    if (series > 0 && series <= SQDIST_MAX_SERIES && n <= SQDIST_MAX_WIN)
+    {
+        nc_type type = file[first].var[i].type;
+        sqdist_series_func kernel = type == NC_FLOAT    ? kernels->series_float[series][n]
+                                    : type == NC_DOUBLE ? kernels->series_double[series][n]
+                                                        : NULL;
+        const void *cols[SQDIST_MAX_SERIES];
+
+        for (int f = first; kernel && f < last; f++)
+        {
+            if (file[f].var[i].type != type)
+                kernel = NULL;
+            cols[f - first] = file[f].var[i].data;
+        }
+
+        if (kernel)
+            return kernel(cols, a, b);
+    }
+
+    for (int f = first; f < last; f++)
+        sum += window_sqdist(&file[f].var[i], a, b, n);
+
+    return sum;
+}
@@ -3,6 +3,8 @@
 #include "randw.h"
 #include "preprocess.h"
 #include "process.h"
+#include "nccache.h"
+#include "ncwriter.h"
 
 // =============================================================================
 // CONFIGURACOES DE PERIODO
@@ -33,17 +35,24 @@ KDTree *kdtree;
  * Suporta diferentes períodos de treino e algoritmos otimizados.
  *
  * Argumentos:
- * argv[1] - Número de threads (1, 2, 4, 8, etc.)
+ * argv[1] - Número de threads (1, 2, 4, 8, etc.) ou "serve"
  * argv[2] - Anos de treino (1, 2, 4, 8)
  * argv[3...] - Arquivos NetCDF (primeiro = predito, demais = preditores)
  *
+ * Com "serve", o programa carrega e pré-processa os arquivos, publica o
+ * conjunto em memória compartilhada e fica residente até receber
+ * SIGINT/SIGTERM; as execuções seguintes com os mesmos arquivos e período
+ * anexam o segmento em vez de ler os arquivos.
+ *
  * Exemplo de uso:
  * ./programa 4 8 dados_preditos.nc dados_preditores.nc
+ * ./programa serve 8 dados_preditos.nc dados_preditores.nc &
  */
 int main(int argc, char *argv[])
 {
     char *T_INIT = NULL;
     char *T_END = NULL;
+    bool serve = strcmp(argv[1], "serve") == 0;
 
     // =============================================================================
     // CONFIGURAÇÃO DE PERÍODOS DE TREINO
@@ -86,7 +95,7 @@ int main(int argc, char *argv[])
     // printf("\n");
 
     // Cabeçalho CSV para resultados
-    printf("n_files,n_threads,t_rdfiles,s_training,e_training,s_prediction,e_prediction,algorithm,t_process,rmse,t_total\n");
+    printf("n_files,n_threads,t_rdfiles,s_training,e_training,s_prediction,e_prediction,t_process,rmse,t_total\n");
 
     // =============================================================================
     // CONFIGURAÇÃO DO ALGORITMO
@@ -102,6 +111,40 @@ int main(int argc, char *argv[])
     ds.num_thread = strtol(argv[1], NULL, 10);  // Número de threads
     ds.argc = argc - 3;                         // Número de arquivos
     ds.indice_generic = 0;                      // Índice genérico para processamento
+    ds.use_mmap = true;                         // Leitura zero-copy (mmap) de arquivos NetCDF-3
+    ds.read_slab = true;                        // Ler apenas o intervalo de tempo dos períodos
+    ds.lazy_load = true;                        // Carregar cada variável só quando for processada
+    ds.store_type = 0;                          // Tipo do arquivo (NC_FLOAT = normalizar para float32, NC_DOUBLE = para double)
+    ds.window_matrix = WINDOW_MATRIX_AUTO;      // Matriz de super janelas do treino na KD-Tree de múltiplas séries, no tipo das séries (NC_FLOAT = float32, NC_DOUBLE, NC_SHORT = int16 ou 0 = ler as séries)
+    ds.window_overfetch = 2;                    // Matriz NC_SHORT: candidatos por vizinho, re-ranqueados com a distância exata
+    ds.windows = NULL;
+    ds.target_window = NULL;
+    ds.use_cache = false;                       // Gravar/reusar a imagem pré-processada (carrega tudo: desliga lazy_load, prefetch e prediction_chunk)
+    ds.cache_dir = "support/nc_cache";          // Diretório das imagens (nccache.h)
+    ds.use_shm = true;                          // Anexar o conjunto publicado por "serve"
+    ds.num_io_thread = 0;                       // Threads de leitura/pré-processamento (0 = uma por CPU)
+    ds.prefetch = true;                         // Carregar a variável n+1 durante o processamento da n
+    ds.prefetching = false;
+    ds.prediction_chunk = 0;                    // Predição em blocos de N pontos (0 = período inteiro; requer use_cache = false)
+    ds.output_dir = NULL;                       // Diretório das séries reconstruídas em NetCDF-4, ex.: "support/output" (NULL = não gravar)
+    ds.output_chunk = 0;                        // Chunk ao longo do tempo (0 = NCWRITER_CHUNK)
+    ds.output_deflate = 1;                      // Nível de compressão (0 = sem compressão)
+    ds.writer = NULL;
+
+    // Com carregamento sob demanda, cada variável é pré-processada pelo
+    // algoritmo quando é carregada (acquire_processing_variable), a menos
+    // que o conjunto inteiro vá ser gravado (cache ou "serve")
+    ds.load_all = !ds.lazy_load || ds.use_cache || serve;
+
+    // =============================================================================
+    // CONFIGURAÇÃO DE PERÍODOS
+    // =============================================================================
+
+    // Resolvidos em índices por create_struct, a partir do eixo de tempo
+    ds.time_start_training = convert_time(TRAINING_INIT(T_INIT));
+    ds.time_end_training = convert_time(TRAINING_END(T_END));
+    ds.time_start_prediction = convert_time(PREDICTION_INIT);
+    ds.time_end_prediction = convert_time(PREDICTION_END);
 
     printf("%i,%i,", ds.argc, ds.num_thread);
 
@@ -119,20 +162,12 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    // =============================================================================
-    // CONFIGURAÇÃO DE PERÍODOS
-    // =============================================================================
-
-    ds.start_training = binary_search(file, convert_time(TRAINING_INIT(T_INIT))) + ds.k;
-    ds.end_training = binary_search(file, convert_time(TRAINING_END(T_END)));
-    ds.start_prediction = binary_search(file, convert_time(PREDICTION_INIT));
-    ds.end_prediction = binary_search(file, convert_time(PREDICTION_END)) - ds.k;
-
+    // Índices absolutos no arquivo (com leitura parcial, ds é relativo ao slab)
     printf("%i,%i,%i,%i,",
-           ds.start_training,
-           ds.end_training,
-           ds.start_prediction,
-           ds.end_prediction);
+           ds.start_training + (int)file->offset,
+           ds.end_training + (int)file->offset,
+           ds.start_prediction + (int)file->offset,
+           ds.end_prediction + (int)file->offset);
 
     // Validação dos períodos
     if (ds.start_training < 0 || ds.end_training < 0 ||
@@ -152,21 +187,21 @@ int main(int argc, char *argv[])
     // PRÉ-PROCESSAMENTO DOS DADOS
     // =============================================================================
 
-    // printf("\n=== PRÉ-PROCESSAMENTO ===\n");
+    // Feito por create_struct (ds.load_all), ao mesmo tempo que a leitura:
+    // contagem de inválidos, interpolação, recontagem e janelas válidas
 
-    // Análise de dados inválidos
-    analyze_data(file, &ds, count_invalid_values);
+    // Gravação da imagem pré-processada, usada pelas próximas execuções
+    if (ds.use_cache && !file->cache)
+        file = nccache_store(file, &ds, &argv[3]);
 
-    GET_START;
-    // Interpolação de valores faltantes
-    analyze_data(file, &ds, interpolation_values);
-    GET_END;
-
-    // Recontagem após interpolação
-    analyze_data(file, &ds, count_invalid_values);
-
-    // Contagem de janelas válidas
-    analyze_data(file, &ds, count_valid_window);
+    // Modo servidor: publica o conjunto e aguarda o sinal de término
+    if (serve)
+    {
+        nccache_serve(file, &ds, &argv[3]);
+        deallocate_memory(file, ds.argc);
+        nc_finalize();
+        return EXIT_SUCCESS;
+    }
 
     // Estatísticas de qualidade dos dados
         // for (int i = 0; i < ds.argc; i++)
@@ -181,15 +216,28 @@ int main(int argc, char *argv[])
 
     // printf("\n=== PROCESSAMENTO ===\n");
 
+    // Kernels de distância conforme a CPU (AVX-512, AVX2 ou escalar)
+    distance_init();
+
+    // Gravação assíncrona das séries reconstruídas, variável a variável
+    if (ds.output_dir)
+        ds.writer = ncwriter_open(file, &ds, argv[3]);
+
     GET_START;
 
     // processing_data(file, &ds, kdanen_independent_parallel);
     // processing_data(file, &ds, anen_dependent_parallel);
+    // processing_data(file, &ds, anen_dependent_parallel_gemm);
+    // processing_data(file, &ds, anen_dependent_parallel_pruned);
     processing_data(file, &ds, kdanen_dependent_parallel);
     // processing_data(file, &ds, kdanen_dependent_parallel_interleaved);
 
     GET_END;
 
+    // Aguarda a escrita das últimas variáveis
+    ncwriter_close(ds.writer);
+    ds.writer = NULL;
+
     // =============================================================================
     // FINALIZAÇÃO
     // =============================================================================
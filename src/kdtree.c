@@ -2,22 +2,107 @@
 #define _GNU_SOURCE
 #include "kdtree.h"
 
-NodePool *create_node_pool()
+NodeArena *node_arena_create(size_t node_size)
 {
-    NodePool *pool = (NodePool *)malloc(sizeof(NodePool));
-    pool->next_available = 0;
-    return pool;
+    NodeArena *arena = (NodeArena *)calloc(1, sizeof(NodeArena));
+    if (arena)
+        arena->node_size = node_size;
+    return arena;
 }
 
-KDTree *allocate_node_from_pool(NodePool *pool, int window_id)
+// Aligned storage for count nodes; an overflow chunk keeps its link in the
+// first NODE_ARENA_ALIGNMENT bytes
+static void *node_arena_block(NodeArena *arena, int count, size_t header)
 {
-    if (pool->next_available >= NODE_POOL_SIZE)
+    void *block = NULL;
+
+    if (posix_memalign(&block, NODE_ARENA_ALIGNMENT, header + (size_t)count * arena->node_size) != 0)
     {
-        // Pool is full, fall back to malloc
-        return create_kdt_node(window_id);
+        fprintf(stderr, "Error: failed to allocate %d KD-tree nodes\n", count);
+        exit(1);
+    }
+    return block;
+}
+
+// Empties the arena and makes room for count nodes in the block
+void node_arena_reserve(NodeArena *arena, int count)
+{
+    node_arena_reset(arena);
+
+    if (count > arena->capacity)
+    {
+        free(arena->block);
+        arena->block = node_arena_block(arena, count, 0);
+        arena->capacity = count;
+    }
+}
+
+void *node_arena_alloc(NodeArena *arena)
+{
+    if (arena->next_available < arena->capacity)
+        return (char *)arena->block + (size_t)arena->next_available++ * arena->node_size;
+
+    // Past the reservation: new chunk, growing with the arena
+    if (!arena->chunks || arena->chunk_used == arena->chunk_capacity)
+    {
+        int count = arena->capacity + arena->overflow > NODE_POOL_SIZE ? arena->capacity + arena->overflow
+                                                                       : NODE_POOL_SIZE;
+        void *chunk = node_arena_block(arena, count, NODE_ARENA_ALIGNMENT);
+
+        *(void **)chunk = arena->chunks;
+        arena->chunks = chunk;
+        arena->chunk_capacity = count;
+        arena->chunk_used = 0;
+    }
+
+    arena->overflow++;
+    return (char *)arena->chunks + NODE_ARENA_ALIGNMENT + (size_t)arena->chunk_used++ * arena->node_size;
+}
+
+// O(1) unless the last tree overflowed: then the chunks are freed and the
+// block grows to hold that tree
+void node_arena_reset(NodeArena *arena)
+{
+    int used = arena->capacity + arena->overflow;
+
+    while (arena->chunks)
+    {
+        void *next = *(void **)arena->chunks;
+        free(arena->chunks);
+        arena->chunks = next;
+    }
+
+    if (arena->overflow > 0)
+    {
+        free(arena->block);
+        arena->block = node_arena_block(arena, used, 0);
+        arena->capacity = used;
     }
 
-    KDTree *node = &(pool->nodes[pool->next_available++]);
+    arena->next_available = 0;
+    arena->chunk_capacity = 0;
+    arena->chunk_used = 0;
+    arena->overflow = 0;
+}
+
+void node_arena_free(NodeArena *arena)
+{
+    if (!arena)
+        return;
+
+    node_arena_reset(arena);
+    free(arena->block);
+    free(arena);
+}
+
+NodePool *create_node_pool()
+{
+    return node_arena_create(sizeof(KDTree));
+}
+
+KDTree *allocate_node_from_pool(NodePool *pool, int window_id)
+{
+    KDTree *node = (KDTree *)node_arena_alloc(pool);
     node->window_id = window_id;
     node->left = NULL;
     node->right = NULL;
@@ -26,12 +111,12 @@ KDTree *allocate_node_from_pool(NodePool *pool, int window_id)
 
 void reset_node_pool(NodePool *pool)
 {
-    pool->next_available = 0;
+    node_arena_reset(pool);
 }
 
 void free_node_pool(NodePool *pool)
 {
-    free(pool);
+    node_arena_free(pool);
 }
 
 // Standard node creation function (fallback)
@@ -241,6 +326,7 @@ KDTree *create_balanced_kdtree(Variable *var, DataSegment *ds)
 
     // Create a node pool for efficient memory allocation
     NodePool *pool = create_node_pool();
+    node_arena_reserve(pool, total_windows);
 
     // Build the balanced tree
     KDTree *root = build_balanced_kdtree(window_ids, total_windows, var, ds, 0, pool);
@@ -296,50 +382,11 @@ KDTree *insert_kdt_node(KDTree *root, Variable *var, DataSegment *ds, int window
 // Optimized distance calculation (squared distance to avoid sqrt)
 double squared_distance_kdtree(KDTree *root, Variable *var, DataSegment *ds, int window_id, int target_id)
 {
-    double sum = 0.0;
-
-    // Optimize for the most common type (NC_FLOAT)
-    if (var->type == NC_FLOAT)
-    {
-        float *data = (float *)var->data;
-        int window_offset = window_id - ds->k;
-        int target_offset = target_id - ds->k;
-
-        for (int i = 0; i < ds->win_size; i++)
-        {
-            float diff = data[window_offset + i] - data[target_offset + i];
-            sum += diff * diff;
-
-            // Early termination if sum exceeds the current best distance
-            if (sum > ds->current_best_distance && ds->current_best_distance > 0)
-                return INFINITY;
-        }
-    }
-    else
-    {
-        // Handle other types
-        switch (var->type)
-        {
-        case NC_DOUBLE:
-        {
-            double *data = (double *)var->data;
-            int window_offset = window_id - ds->k;
-            int target_offset = target_id - ds->k;
+    double sum = window_sqdist(var, window_id - ds->k, target_id - ds->k, ds->win_size);
 
-            for (int i = 0; i < ds->win_size; i++)
-            {
-                double diff = data[window_offset + i] - data[target_offset + i];
-                sum += diff * diff;
-                if (sum > ds->current_best_distance && ds->current_best_distance > 0)
-                {
-                    return INFINITY;
-                }
-            }
-            break;
-        }
-            // Add cases for other types
-        }
-    }
+    // Early termination if sum exceeds the current best distance (partial sums only grow)
+    if (sum > ds->current_best_distance && ds->current_best_distance > 0)
+        return INFINITY;
 
     return sum;
 }
@@ -359,20 +406,8 @@ double monache_metric_kdtree(KDTree *root, Variable *var, DataSegment *ds, int w
 
 double monache_metric_super_window_kdtree(KDTree *root, NetCDF *file, DataSegment *ds, int window_id, int target_id, int i)
 {
-    double sum = 0.0;
-
-    for (int f = 0; f < (ds->argc - 1); f++) // Soma sobre séries temporais
-    {
-        switch (file[f].var[i].type)
-        {
-            MONACHESW_KDTREE(NC_INT);
-            MONACHESW_KDTREE(NC_FLOAT);
-            MONACHESW_KDTREE(NC_DOUBLE);
-            MONACHESW_KDTREE(NC_UINT);
-            MONACHESW_KDTREE(NC_INT64);
-            MONACHESW_KDTREE(NC_UINT64);
-        }
-    }
+    // Soma sobre séries temporais
+    double sum = series_sqdist(file, 0, ds->argc - 1, i, target_id - ds->k, root->window_id - ds->k, ds->win_size);
 
     // return isnan(sum) ? NAN : sum;
     return isnan(sum) ? NAN : sqrt(sum);
@@ -434,29 +469,10 @@ void search_closest_points(KDTree *root, Variable *var, DataSegment *ds, Closest
     {
         double distance = sqrt(squared_dist);
 
-        if (*found < ds->num_Na)
-        {
-            closest[*found].window_index = root->window_id;
-            closest[*found].distance = distance;
-            (*found)++;
-
-            if (*found == ds->num_Na)
-            {
-                // When we've found enough points, sort them
-                qsort(closest, ds->num_Na, sizeof(ClosestPoint), compare_near_point);
-                // Save the current best distance for early termination
-                ds->current_best_distance = closest[0].distance * closest[0].distance;
-            }
-        }
-        else if (distance < closest[0].distance)
-        {
-            // Found a better point
-            closest[0].window_index = root->window_id;
-            closest[0].distance = distance;
-            qsort(closest, ds->num_Na, sizeof(ClosestPoint), compare_near_point);
-            // Update the current best distance
+        // Keep the point if it is among the num_Na closest so far; once the
+        // heap is full, save the current best distance for early termination
+        if (topk_push(closest, found, ds->num_Na, root->window_id, distance) && *found == ds->num_Na)
             ds->current_best_distance = closest[0].distance * closest[0].distance;
-        }
     }
 
     // Determine which child to visit first
@@ -548,24 +564,8 @@ void search_closest_points_super_window(KDTree *root, NetCDF *file, DataSegment
 
     if (!isnan(distance))
     {
-        if (*found < ds->num_Na)
-        {
-            closest[*found].window_index = root->window_id;
-            closest[*found].distance = distance;
-            (*found)++;
-            if (*found == ds->num_Na)
-            {
-                qsort(closest, ds->num_Na, sizeof(ClosestPoint), compare_near_point);
-                ds->current_best_distance = closest[0].distance * closest[0].distance;
-            }
-        }
-        else if (distance < closest[0].distance)
-        {
-            closest[0].window_index = root->window_id;
-            closest[0].distance = distance;
-            qsort(closest, ds->num_Na, sizeof(ClosestPoint), compare_near_point);
+        if (topk_push(closest, found, ds->num_Na, root->window_id, distance) && *found == ds->num_Na)
             ds->current_best_distance = closest[0].distance * closest[0].distance;
-        }
     }
 
     KDTree *first_child = NULL;
@@ -646,25 +646,8 @@ void search_closest_points_optimized(KDTree *root, Variable *var, DataSegment *d
     {
         double distance = sqrt(squared_dist);
 
-        if (*found < ds->num_Na)
-        {
-            closest[*found].window_index = root->window_id;
-            closest[*found].distance = distance;
-            (*found)++;
-
-            if (*found == ds->num_Na)
-            {
-                qsort(closest, ds->num_Na, sizeof(ClosestPoint), compare_near_point);
-                ds->current_best_distance = closest[0].distance * closest[0].distance;
-            }
-        }
-        else if (distance < closest[0].distance)
-        {
-            closest[0].window_index = root->window_id;
-            closest[0].distance = distance;
-            qsort(closest, ds->num_Na, sizeof(ClosestPoint), compare_near_point);
+        if (topk_push(closest, found, ds->num_Na, root->window_id, distance) && *found == ds->num_Na)
             ds->current_best_distance = closest[0].distance * closest[0].distance;
-        }
     }
 
     // Determinar ordem de visita dos filhos
@@ -745,6 +728,7 @@ KDTree *rebalance_kdtree(KDTree *root, Variable *var, DataSegment *ds)
 
     // Create a node pool for efficient memory allocation
     NodePool *pool = create_node_pool();
+    node_arena_reserve(pool, node_count);
 
     // Deallocate old tree
     deallocate_kdtree(root);
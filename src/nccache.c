@@ -0,0 +1,584 @@
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+
+#include "nccache.h"
+#include "randw.h"
+
+/*
+ * Binary image of a preprocessed dataset. After the first run over a set
+ * of files (NaN normalization, interpolation and window counts done), every
+ * column is written once, aligned to NCCACHE_ALIGN, with the validity
+ * metadata of its variable. Later runs with the same sources and
+ * preprocessing parameters map the image and point Variable.data straight
+ * into it, skipping NetCDF parsing and preprocessing altogether.
+ *
+ * The image name is a hash of the parameters and of the source paths; the
+ * header records the content hash of each source, checked again (only when
+ * its size/mtime changed) before the image is used.
+ *
+ * The same image can be published in a POSIX shared-memory segment
+ * (nccache_serve), named after the same key, which other runs attach
+ * read-only (nccache_attach) instead of mapping the file.
+ */
+
+#define NCCACHE_SEED 0xcbf29ce484222325ULL
+#define NCCACHE_PRIME 0x100000001b3ULL
+
+static uint64_t hash_bytes(const void *data, size_t size, uint64_t h)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    size_t i = 0;
+
+    /* FNV-1a over 8-byte words, with a shift to mix the high bits down */
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        h = (h ^ word) * NCCACHE_PRIME;
+        h ^= h >> 29;
+    }
+    for (; i < size; i++)
+        h = (h ^ bytes[i]) * NCCACHE_PRIME;
+
+    return h;
+}
+
+static bool stat_source(const char *path, NcCacheSource *source)
+{
+    struct stat st;
+
+    if (stat(path, &st) != 0)
+        return false;
+
+    source->size = (uint64_t)st.st_size;
+    source->mtime_sec = (int64_t)st.st_mtim.tv_sec;
+    source->mtime_nsec = (int64_t)st.st_mtim.tv_nsec;
+    return true;
+}
+
+static bool hash_source(const char *path, NcCacheSource *source)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || !stat_source(path, source))
+    {
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    source->hash = NCCACHE_SEED;
+    if (source->size > 0)
+    {
+        void *data = mmap(NULL, source->size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            close(fd);
+            return false;
+        }
+        madvise(data, source->size, MADV_SEQUENTIAL);
+        source->hash = hash_bytes(data, source->size, NCCACHE_SEED);
+        munmap(data, source->size);
+    }
+    close(fd);
+    return true;
+}
+
+static bool source_matches(const char *path, const NcCacheSource *cached)
+{
+    NcCacheSource current;
+
+    if (!stat_source(path, &current) || current.size != cached->size)
+        return false;
+
+    /* Unchanged size and mtime: trust the recorded hash */
+    if (current.mtime_sec == cached->mtime_sec && current.mtime_nsec == cached->mtime_nsec)
+        return true;
+
+    return hash_source(path, &current) && current.hash == cached->hash;
+}
+
+static void cache_params(DataSegment *ds, NcCacheParams *params)
+{
+    memset(params, 0, sizeof(NcCacheParams));
+    params->nfiles = ds->argc;
+    params->k = ds->k;
+    params->win_size = ds->win_size;
+    params->win_size_interpolation = ds->win_size_interpolation;
+    params->read_slab = ds->read_slab;
+    params->store_type = ds->store_type;
+    params->time_start_training = ds->time_start_training;
+    params->time_end_training = ds->time_end_training;
+    params->time_start_prediction = ds->time_start_prediction;
+    params->time_end_prediction = ds->time_end_prediction;
+}
+
+static uint64_t cache_key(DataSegment *ds, char *argv[])
+{
+    NcCacheParams params;
+    uint64_t key;
+
+    cache_params(ds, &params);
+    key = hash_bytes(&params, sizeof(params), NCCACHE_SEED);
+
+    for (int i = 0; i < ds->argc; i++)
+    {
+        char resolved[PATH_MAX];
+        const char *name = realpath(argv[i], resolved) ? resolved : argv[i];
+        key = hash_bytes(name, strlen(name) + 1, key);
+    }
+
+    return key;
+}
+
+static void cache_path(DataSegment *ds, char *argv[], char *path, size_t size)
+{
+    snprintf(path, size, "%s/%016llx%s", ds->cache_dir,
+             (unsigned long long)cache_key(ds, argv), NCCACHE_EXTENSION);
+}
+
+static void shm_name(DataSegment *ds, char *argv[], char *name, size_t size)
+{
+    snprintf(name, size, "%s%016llx", NCCACHE_SHM_PREFIX, (unsigned long long)cache_key(ds, argv));
+}
+
+static size_t element_size(nc_type type)
+{
+    switch (type)
+    {
+    case NC_BYTE:
+    case NC_CHAR:
+    case NC_UBYTE:
+        return 1;
+    case NC_SHORT:
+    case NC_USHORT:
+        return 2;
+    case NC_INT:
+    case NC_FLOAT:
+    case NC_UINT:
+        return 4;
+    case NC_DOUBLE:
+    case NC_INT64:
+    case NC_UINT64:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+static size_t align_up(size_t value)
+{
+    return (value + NCCACHE_ALIGN - 1) / NCCACHE_ALIGN * NCCACHE_ALIGN;
+}
+
+/*
+ * Build the dataset described by the image at base. Returns NULL when the
+ * image does not match ds or the sources; the caller owns the mapping
+ * until it is handed over to the returned files.
+ */
+static NetCDF *load_image(DataSegment *ds, char *argv[], unsigned char *base, size_t size)
+{
+    NcCacheHeader *header = (NcCacheHeader *)base;
+    NcCacheParams params;
+
+    cache_params(ds, &params);
+
+    if (size < sizeof(NcCacheHeader) ||
+        memcmp(header->magic, NCCACHE_MAGIC, sizeof(NCCACHE_MAGIC)) != 0 ||
+        header->version != NCCACHE_VERSION || header->size != size ||
+        header->header_size > size ||
+        memcmp(&header->params, &params, sizeof(params)) != 0)
+        return NULL;
+
+    NcCache *cache = (NcCache *)malloc(sizeof(NcCache));
+    NetCDF *file = (NetCDF *)calloc(ds->argc, sizeof(NetCDF));
+    if (cache == NULL || file == NULL)
+    {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        exit(1);
+    }
+    cache->base = base;
+    cache->size = size;
+
+    size_t pos = sizeof(NcCacheHeader);
+    bool valid = true;
+
+    for (int i = 0; i < ds->argc && valid; i++)
+    {
+        NcCacheFile *cfile = (NcCacheFile *)(base + pos);
+        pos += sizeof(NcCacheFile);
+
+        if (pos > header->header_size || !source_matches(argv[i], &cfile->source))
+        {
+            valid = false;
+            break;
+        }
+
+        /* Counts of a truncated or stale image must not take the copies past the header */
+        if (cfile->ndims < 0 || cfile->ndims > NC_MAX_DIMS ||
+            cfile->nvars < 0 || cfile->nvars > NC_MAX_VARS ||
+            pos + cfile->ndims * sizeof(Dimension) > header->header_size)
+        {
+            valid = false;
+            break;
+        }
+
+        file[i].ncid_in = -1;
+        file[i].ndims = cfile->ndims;
+        file[i].nvars = cfile->nvars;
+        file[i].offset = cfile->offset;
+        file[i].cache = cache;
+
+        file[i].dim = (Dimension *)malloc(cfile->ndims * sizeof(Dimension));
+        file[i].var = (Variable *)calloc(cfile->nvars, sizeof(Variable));
+        if (file[i].dim == NULL || file[i].var == NULL)
+        {
+            fprintf(stderr, "Error: Memory allocation failed.\n");
+            exit(1);
+        }
+
+        memcpy(file[i].dim, base + pos, cfile->ndims * sizeof(Dimension));
+        pos += cfile->ndims * sizeof(Dimension);
+
+        for (int j = 0; j < cfile->nvars; j++)
+        {
+            NcCacheVar *cvar = (NcCacheVar *)(base + pos);
+            Variable *var = &file[i].var[j];
+            pos += sizeof(NcCacheVar);
+
+            if (pos > header->header_size ||
+                cvar->data_offset + cvar->count * element_size(cvar->type) > size)
+            {
+                valid = false;
+                break;
+            }
+
+            memcpy(var->name, cvar->name, sizeof(var->name));
+            var->type = cvar->type;
+            var->id = cvar->id;
+            var->invalid_count = cvar->invalid_count;
+            var->num_win_valid_training = cvar->num_win_valid_training;
+            var->num_win_valid_prediction = cvar->num_win_valid_prediction;
+            var->invalid_percentage = cvar->invalid_percentage;
+            var->data = base + cvar->data_offset;
+            var->storage = DATA_MAPPED;
+            var->ready = true;
+        }
+    }
+
+    if (!valid)
+    {
+        for (int i = 0; i < ds->argc; i++)
+        {
+            free(file[i].dim);
+            free(file[i].var);
+        }
+        free(file);
+        free(cache);
+        return NULL;
+    }
+
+    ds->start_training = header->start_training;
+    ds->end_training = header->end_training;
+    ds->start_prediction = header->start_prediction;
+    ds->end_prediction = header->end_prediction;
+
+    return file;
+}
+
+/*
+ * Write the image of the (preprocessed) dataset to out. Columns go first
+ * and the header last, so a reader of a segment still being written never
+ * sees a valid magic before the data is complete.
+ */
+static bool write_image(NetCDF *file, DataSegment *ds, char *argv[], FILE *out)
+{
+    size_t header_size = sizeof(NcCacheHeader);
+
+    for (int i = 0; i < ds->argc; i++)
+    {
+        header_size += sizeof(NcCacheFile) + file[i].ndims * sizeof(Dimension) +
+                       file[i].nvars * sizeof(NcCacheVar);
+
+        for (int j = 0; j < file[i].nvars; j++)
+        {
+            if (file[i].var[j].data == NULL || element_size(file[i].var[j].type) == 0)
+            {
+                fprintf(stderr, "Warning: Variable %s cannot be cached.\n", file[i].var[j].name);
+                return false;
+            }
+        }
+    }
+    header_size = align_up(header_size);
+
+    unsigned char *header = (unsigned char *)calloc(1, header_size);
+    if (header == NULL)
+    {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        exit(1);
+    }
+
+    /* Header blocks; columns are laid out right after them */
+    NcCacheHeader *cheader = (NcCacheHeader *)header;
+    size_t pos = sizeof(NcCacheHeader);
+    size_t data_offset = header_size;
+
+    memcpy(cheader->magic, NCCACHE_MAGIC, sizeof(NCCACHE_MAGIC));
+    cheader->version = NCCACHE_VERSION;
+    cheader->header_size = (uint32_t)header_size;
+    cache_params(ds, &cheader->params);
+    cheader->start_training = ds->start_training;
+    cheader->end_training = ds->end_training;
+    cheader->start_prediction = ds->start_prediction;
+    cheader->end_prediction = ds->end_prediction;
+
+    for (int i = 0; i < ds->argc; i++)
+    {
+        NcCacheFile *cfile = (NcCacheFile *)(header + pos);
+        pos += sizeof(NcCacheFile);
+
+        if (!hash_source(argv[i], &cfile->source))
+        {
+            fprintf(stderr, "Warning: Failed to hash %s, cache not written.\n", argv[i]);
+            free(header);
+            return false;
+        }
+        cfile->ndims = file[i].ndims;
+        cfile->nvars = file[i].nvars;
+        cfile->offset = file[i].offset;
+
+        memcpy(header + pos, file[i].dim, file[i].ndims * sizeof(Dimension));
+        pos += file[i].ndims * sizeof(Dimension);
+
+        for (int j = 0; j < file[i].nvars; j++)
+        {
+            NcCacheVar *cvar = (NcCacheVar *)(header + pos);
+            Variable *var = &file[i].var[j];
+            pos += sizeof(NcCacheVar);
+
+            memcpy(cvar->name, var->name, sizeof(cvar->name));
+            cvar->type = var->type;
+            cvar->id = var->id;
+            cvar->invalid_count = var->invalid_count;
+            cvar->num_win_valid_training = var->num_win_valid_training;
+            cvar->num_win_valid_prediction = var->num_win_valid_prediction;
+            cvar->invalid_percentage = var->invalid_percentage;
+            cvar->data_offset = data_offset;
+            cvar->count = file[i].dim->len;
+
+            data_offset = align_up(data_offset + cvar->count * element_size(var->type));
+        }
+    }
+    cheader->size = data_offset;
+
+    bool written = ftruncate(fileno(out), (off_t)cheader->size) == 0;
+    pos = sizeof(NcCacheHeader);
+
+    for (int i = 0; i < ds->argc && written; i++)
+    {
+        pos += sizeof(NcCacheFile) + file[i].ndims * sizeof(Dimension);
+
+        for (int j = 0; j < file[i].nvars && written; j++)
+        {
+            NcCacheVar *cvar = (NcCacheVar *)(header + pos);
+            size_t bytes = cvar->count * element_size(cvar->type);
+            pos += sizeof(NcCacheVar);
+
+            written = fseek(out, (long)cvar->data_offset, SEEK_SET) == 0 &&
+                      fwrite(file[i].var[j].data, 1, bytes, out) == bytes;
+        }
+    }
+
+    written = written && fflush(out) == 0 &&
+              fseek(out, 0, SEEK_SET) == 0 &&
+              fwrite(header, 1, header_size, out) == header_size &&
+              fflush(out) == 0;
+
+    free(header);
+    return written;
+}
+
+NetCDF *nccache_load(DataSegment *ds, char *argv[])
+{
+    char path[PATH_MAX];
+    struct stat st;
+
+    cache_path(ds, argv, path, sizeof(path));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = (size_t)st.st_size;
+    unsigned char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    NetCDF *file = load_image(ds, argv, base, size);
+    if (file == NULL)
+        munmap(base, size);
+
+    return file;
+}
+
+NetCDF *nccache_attach(DataSegment *ds, char *argv[])
+{
+    char name[64];
+    struct stat st;
+
+    shm_name(ds, argv, name, sizeof(name));
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = (size_t)st.st_size;
+    unsigned char *base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    NetCDF *file = load_image(ds, argv, base, size);
+    if (file == NULL)
+        munmap(base, size);
+
+    return file;
+}
+
+NetCDF *nccache_store(NetCDF *file, DataSegment *ds, char *argv[])
+{
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX + 32];
+
+    /* Written under a temporary name so readers never see a partial image */
+    if (mkdir(ds->cache_dir, 0755) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "Warning: Failed to create %s, cache not written.\n", ds->cache_dir);
+        return file;
+    }
+
+    cache_path(ds, argv, path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, (int)getpid());
+
+    FILE *out = fopen(tmp_path, "wb");
+    if (out == NULL)
+    {
+        fprintf(stderr, "Warning: Failed to create %s, cache not written.\n", tmp_path);
+        return file;
+    }
+
+    bool written = write_image(file, ds, argv, out);
+    written = (fclose(out) == 0) && written;
+
+    if (!written || rename(tmp_path, path) != 0)
+    {
+        fprintf(stderr, "Warning: Failed to write %s.\n", path);
+        unlink(tmp_path);
+        return file;
+    }
+
+    /* Continue from the image, exactly as a later run would */
+    NetCDF *cached = nccache_load(ds, argv);
+    if (cached == NULL)
+        return file;
+
+    deallocate_memory(file, ds->argc);
+    return cached;
+}
+
+void nccache_serve(NetCDF *file, DataSegment *ds, char *argv[])
+{
+    char name[64];
+    sigset_t signals, pending;
+    int signal_number;
+
+    shm_name(ds, argv, name, sizeof(name));
+
+    /*
+     * Blocked before the segment exists, so that a stop request during the
+     * write cannot kill the process and leave the segment behind
+     */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Error: Failed to create shared memory %s (already served?).\n", name);
+        exit(1);
+    }
+
+    FILE *out = fdopen(fd, "w+b");
+    if (out == NULL || !write_image(file, ds, argv, out))
+    {
+        fprintf(stderr, "Error: Failed to write shared memory %s.\n", name);
+        shm_unlink(name);
+        exit(1);
+    }
+    fclose(out);
+
+    /* Asked to stop while writing: never announce the segment */
+    sigpending(&pending);
+    if (sigismember(&pending, SIGINT) || sigismember(&pending, SIGTERM) || sigismember(&pending, SIGHUP))
+    {
+        shm_unlink(name);
+        return;
+    }
+
+    /* Stay resident until asked to stop, then remove the segment */
+    fprintf(stderr, "Serving %s (pid %d).\n", name, (int)getpid());
+    sigwait(&signals, &signal_number);
+
+    shm_unlink(name);
+}
+
+/*
+ * Columns are clean file-backed pages: dropping them frees the memory and
+ * they are simply read back from the image if touched again.
+ */
+void nccache_release_variable(NetCDF *file, int i)
+{
+    Variable *var = &file->var[i];
+    NcCache *cache = file->cache;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t lo = (size_t)((unsigned char *)var->data - cache->base);
+    size_t hi = lo + file->dim->len * element_size(var->type);
+    size_t page_lo = (lo + page - 1) / page * page;
+    size_t page_hi = hi / page * page;
+
+    if (page_lo < page_hi)
+        madvise(cache->base + page_lo, page_hi - page_lo, MADV_DONTNEED);
+}
+
+void nccache_close(NetCDF *file)
+{
+    NcCache *cache = file->cache;
+
+    if (cache == NULL)
+        return;
+
+    munmap(cache->base, cache->size);
+    free(cache);
+    file->cache = NULL;
+}
@@ -0,0 +1,470 @@
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ncmmap.h"
+
+/*
+ * Zero-copy loader for NetCDF-3 files (classic, 64-bit offset and 64-bit
+ * data). The file is mapped with MAP_PRIVATE and the header is parsed here,
+ * so Variable.data can point straight into the mapping. The format stores
+ * values big-endian: each variable is byte-swapped in place the first time
+ * it is requested, which only dirties (copies) the pages of the variables
+ * actually used. NetCDF-4/HDF5 files are rejected so the caller can fall
+ * back to libnetcdf.
+ */
+
+typedef struct
+{
+    const unsigned char *pos;
+    const unsigned char *end;
+    int version;
+} HeaderCursor;
+
+static void header_error(const char *msg)
+{
+    fprintf(stderr, "Error: Invalid NetCDF-3 header (%s).\n", msg);
+    exit(1);
+}
+
+static uint64_t read_be(HeaderCursor *c, int bytes)
+{
+    uint64_t value = 0;
+
+    if (c->end - c->pos < bytes)
+        header_error("truncated");
+
+    for (int i = 0; i < bytes; i++)
+        value = (value << 8) | *c->pos++;
+
+    return value;
+}
+
+/* INT fields: always 32 bits */
+static uint64_t read_int(HeaderCursor *c)
+{
+    return read_be(c, 4);
+}
+
+/* NON_NEG fields: 64 bits in CDF-5, 32 bits otherwise */
+static uint64_t read_nonneg(HeaderCursor *c)
+{
+    return read_be(c, c->version == NCMAP_64BIT_DATA ? 8 : 4);
+}
+
+/* OFFSET fields: 32 bits only in CDF-1 */
+static uint64_t read_offset(HeaderCursor *c)
+{
+    return read_be(c, c->version == NCMAP_CLASSIC ? 4 : 8);
+}
+
+static void skip_padded(HeaderCursor *c, uint64_t bytes)
+{
+    uint64_t padded = (bytes + 3) & ~(uint64_t)3;
+
+    if ((uint64_t)(c->end - c->pos) < padded)
+        header_error("truncated");
+
+    c->pos += padded;
+}
+
+static void read_name(HeaderCursor *c, char *name)
+{
+    uint64_t len = read_nonneg(c);
+
+    if (len > NC_MAX_NAME || (uint64_t)(c->end - c->pos) < len)
+        header_error("bad name");
+
+    memcpy(name, c->pos, len);
+    name[len] = '\0';
+    skip_padded(c, len);
+}
+
+static size_t type_size(nc_type type)
+{
+    switch (type)
+    {
+    case NC_BYTE:
+    case NC_CHAR:
+    case NC_UBYTE:
+        return 1;
+    case NC_SHORT:
+    case NC_USHORT:
+        return 2;
+    case NC_INT:
+    case NC_FLOAT:
+    case NC_UINT:
+        return 4;
+    case NC_DOUBLE:
+    case NC_INT64:
+    case NC_UINT64:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+static void skip_attributes(HeaderCursor *c)
+{
+    uint64_t tag = read_int(c);
+    uint64_t nelems = read_nonneg(c);
+
+    if (tag != NCMAP_TAG_ATTRIBUTE && !(tag == 0 && nelems == 0))
+        header_error("bad attribute list");
+
+    for (uint64_t i = 0; i < nelems; i++)
+    {
+        char name[NC_MAX_NAME + 1];
+        read_name(c, name);
+
+        size_t size = type_size((nc_type)read_int(c));
+        if (size == 0)
+            header_error("bad attribute type");
+
+        skip_padded(c, read_nonneg(c) * size);
+    }
+}
+
+static void swap_in_place(unsigned char *data, size_t count, size_t elem_size)
+{
+    switch (elem_size)
+    {
+    case 2:
+    {
+        uint16_t *v = (uint16_t *)data;
+        for (size_t i = 0; i < count; i++)
+            v[i] = __builtin_bswap16(v[i]);
+        break;
+    }
+    case 4:
+    {
+        uint32_t *v = (uint32_t *)data;
+        for (size_t i = 0; i < count; i++)
+            v[i] = __builtin_bswap32(v[i]);
+        break;
+    }
+    case 8:
+    {
+        uint64_t *v = (uint64_t *)data;
+        for (size_t i = 0; i < count; i++)
+            v[i] = __builtin_bswap64(v[i]);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/* Bytes of one record of a record variable, or of the whole variable */
+static size_t chunk_bytes(NcMap *map, NcMapVar *mvar)
+{
+    if (mvar->is_record)
+        return map->numrecs ? mvar->count / map->numrecs * mvar->elem_size : 0;
+
+    return mvar->count * mvar->elem_size;
+}
+
+static void parse_header(NetCDF *file, NcMap *map)
+{
+    HeaderCursor c = {map->base + 4, map->base + map->size, map->version};
+
+    map->numrecs = read_nonneg(&c);
+    map->recdim = -1;
+
+    /* Dimensions */
+    uint64_t tag = read_int(&c);
+    file->ndims = (int)read_nonneg(&c);
+    if ((tag != NCMAP_TAG_DIMENSION && !(tag == 0 && file->ndims == 0)) ||
+        file->ndims < 0 || file->ndims > NC_MAX_DIMS)
+        header_error("bad dimension list");
+
+    file->dim = (Dimension *)malloc((file->ndims ? file->ndims : 1) * sizeof(Dimension));
+    for (int i = 0; i < file->ndims; i++)
+    {
+        read_name(&c, file->dim[i].name);
+        file->dim[i].len = read_nonneg(&c);
+
+        if (file->dim[i].len == 0)
+            map->recdim = i;
+    }
+
+    /* Global attributes are not used */
+    skip_attributes(&c);
+
+    /* Variables */
+    tag = read_int(&c);
+    file->nvars = (int)read_nonneg(&c);
+    if ((tag != NCMAP_TAG_VARIABLE && !(tag == 0 && file->nvars == 0)) ||
+        file->nvars < 0 || file->nvars > NC_MAX_VARS)
+        header_error("bad variable list");
+
+    file->var = (Variable *)calloc(file->nvars ? file->nvars : 1, sizeof(Variable));
+    map->vars = (NcMapVar *)calloc(file->nvars ? file->nvars : 1, sizeof(NcMapVar));
+
+    int num_record_vars = 0;
+    size_t last_record_size = 0;
+
+    for (int i = 0; i < file->nvars; i++)
+    {
+        Variable *var = &file->var[i];
+        NcMapVar *mvar = &map->vars[i];
+        size_t per_record = 1;
+
+        read_name(&c, var->name);
+        var->id = i;
+        var->ndims = (int)read_nonneg(&c);
+        if (var->ndims < 0 || var->ndims > NC_MAX_VAR_DIMS)
+            header_error("bad variable rank");
+
+        for (int d = 0; d < var->ndims; d++)
+        {
+            int dimid = (int)read_nonneg(&c);
+            if (dimid < 0 || dimid >= file->ndims)
+                header_error("bad dimension id");
+
+            if (d == 0 && dimid == map->recdim)
+                mvar->is_record = true;
+            else
+                per_record *= file->dim[dimid].len;
+        }
+
+        skip_attributes(&c);
+
+        var->type = (nc_type)read_int(&c);
+        mvar->elem_size = type_size(var->type);
+        if (mvar->elem_size == 0)
+            header_error("bad variable type");
+
+        size_t vsize = read_nonneg(&c);
+        mvar->begin = read_offset(&c);
+        mvar->count = per_record;
+
+        if (mvar->is_record)
+        {
+            map->recsize += vsize;
+            last_record_size = per_record * mvar->elem_size;
+            num_record_vars++;
+        }
+    }
+
+    /* A single record variable is stored without padding between records */
+    if (num_record_vars == 1)
+        map->recsize = last_record_size;
+
+    if (map->recdim >= 0)
+    {
+        if ((map->numrecs == NCMAP_STREAMING || map->numrecs == UINT64_MAX) && map->recsize > 0)
+        {
+            size_t first = map->size;
+            for (int i = 0; i < file->nvars; i++)
+                if (map->vars[i].is_record && map->vars[i].begin < first)
+                    first = map->vars[i].begin;
+            map->numrecs = (map->size - first) / map->recsize;
+        }
+        file->dim[map->recdim].len = map->numrecs;
+
+        for (int i = 0; i < file->nvars; i++)
+            if (map->vars[i].is_record)
+                map->vars[i].count *= map->numrecs;
+    }
+}
+
+/*
+ * Map the file and read its header into file->dim/file->var. Returns false,
+ * leaving the file untouched, when the file is not NetCDF-3 (e.g. NetCDF-4/
+ * HDF5) so that the caller can use libnetcdf instead.
+ */
+bool ncmap_open(NetCDF *file, const char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return false;
+
+    if (fstat(fd, &st) != 0 || st.st_size < 8)
+    {
+        close(fd);
+        return false;
+    }
+
+    unsigned char magic[4];
+    if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+        memcmp(magic, NCMAP_MAGIC, 3) != 0 ||
+        (magic[3] != NCMAP_CLASSIC && magic[3] != NCMAP_64BIT_OFFSET && magic[3] != NCMAP_64BIT_DATA))
+    {
+        close(fd);
+        return false;
+    }
+
+    void *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (base == MAP_FAILED)
+        return false;
+
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+    NcMap *map = (NcMap *)calloc(1, sizeof(NcMap));
+    map->base = (unsigned char *)base;
+    map->size = st.st_size;
+    map->version = magic[3];
+
+    file->ncid_in = -1;
+    file->map = map;
+    parse_header(file, map);
+
+    for (int i = 0; i < file->nvars; i++)
+    {
+        NcMapVar *mvar = &map->vars[i];
+        size_t last = mvar->begin + chunk_bytes(map, mvar);
+
+        if (mvar->is_record && map->numrecs > 0)
+            last += (map->numrecs - 1) * map->recsize;
+
+        if (last > map->size)
+            header_error("variable data beyond end of file");
+    }
+
+    return true;
+}
+
+/*
+ * Return the native-endian data of elements [start, start + count) of
+ * variable i. Contiguous variables are swapped inside the mapping, keeping
+ * a single swapped range per variable so later requests for overlapping
+ * ranges reuse it. Record variables interleaved with others and variables
+ * not aligned to their element size are gathered into a heap buffer
+ * instead (owned by the caller through Variable.storage).
+ */
+void *ncmap_variable_data(NetCDF *file, int i, size_t start, size_t count)
+{
+    NcMap *map = file->map;
+    NcMapVar *mvar = &map->vars[i];
+    Variable *var = &file->var[i];
+    size_t chunk = chunk_bytes(map, mvar);
+    size_t end = start + count;
+
+    if (end > mvar->count)
+    {
+        fprintf(stderr, "Error: Range [%zu, %zu) outside of variable %s.\n", start, end, var->name);
+        exit(1);
+    }
+
+    bool interleaved = mvar->is_record && map->numrecs > 1 && map->recsize != chunk;
+
+    if (!interleaved && mvar->begin % mvar->elem_size == 0)
+    {
+        unsigned char *data = map->base + mvar->begin;
+
+        if (mvar->swapped_start == mvar->swapped_end)
+        {
+            swap_in_place(data + start * mvar->elem_size, count, mvar->elem_size);
+            mvar->swapped_start = start;
+            mvar->swapped_end = end;
+        }
+        else
+        {
+            /* Grow the swapped range so that it stays contiguous */
+            size_t lo = start < mvar->swapped_start ? start : mvar->swapped_start;
+            size_t hi = end > mvar->swapped_end ? end : mvar->swapped_end;
+
+            swap_in_place(data + lo * mvar->elem_size, mvar->swapped_start - lo, mvar->elem_size);
+            swap_in_place(data + mvar->swapped_end * mvar->elem_size, hi - mvar->swapped_end, mvar->elem_size);
+            mvar->swapped_start = lo;
+            mvar->swapped_end = hi;
+        }
+
+        var->data = data + start * mvar->elem_size;
+        var->storage = DATA_MAPPED;
+    }
+    else
+    {
+        unsigned char *data = (unsigned char *)malloc(count * mvar->elem_size + 1);
+
+        if (data == NULL)
+        {
+            fprintf(stderr, "Error: Failed to allocate memory.\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if (mvar->is_record)
+        {
+            /* One element per record for the 1-D series handled here */
+            size_t per_record = chunk / mvar->elem_size;
+            for (size_t j = start; j < end; j++)
+                memcpy(data + (j - start) * mvar->elem_size,
+                       map->base + mvar->begin + (j / per_record) * map->recsize + (j % per_record) * mvar->elem_size,
+                       mvar->elem_size);
+        }
+        else
+        {
+            memcpy(data, map->base + mvar->begin + start * mvar->elem_size, count * mvar->elem_size);
+        }
+
+        swap_in_place(data, count, mvar->elem_size);
+        var->data = data;
+        var->storage = DATA_HEAP;
+    }
+
+    return var->data;
+}
+
+/*
+ * Give back the memory of variable i. Heap (gathered) copies are freed; for
+ * mapped variables the whole pages of the swapped range are dropped with
+ * MADV_DONTNEED, so they fall back to the (unswapped) file pages, and the
+ * partial pages at both ends are swapped back to big-endian by hand since
+ * they may be shared with the neighbouring variables.
+ */
+void ncmap_release_variable(NetCDF *file, int i)
+{
+    NcMapVar *mvar = &file->map->vars[i];
+    Variable *var = &file->var[i];
+
+    if (var->storage == DATA_HEAP)
+    {
+        free(var->data);
+        var->data = NULL;
+        return;
+    }
+
+    if (mvar->swapped_start != mvar->swapped_end)
+    {
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t lo = mvar->begin + mvar->swapped_start * mvar->elem_size;
+        size_t hi = mvar->begin + mvar->swapped_end * mvar->elem_size;
+        size_t page_lo = (lo + page - 1) / page * page;
+        size_t page_hi = hi / page * page;
+
+        if (page_lo < page_hi)
+        {
+            swap_in_place(file->map->base + lo, (page_lo - lo) / mvar->elem_size, mvar->elem_size);
+            swap_in_place(file->map->base + page_hi, (hi - page_hi) / mvar->elem_size, mvar->elem_size);
+            madvise(file->map->base + page_lo, page_hi - page_lo, MADV_DONTNEED);
+        }
+        else
+        {
+            swap_in_place(file->map->base + lo, (hi - lo) / mvar->elem_size, mvar->elem_size);
+        }
+
+        mvar->swapped_start = mvar->swapped_end = 0;
+    }
+
+    var->data = NULL;
+}
+
+void ncmap_close(NetCDF *file)
+{
+    NcMap *map = file->map;
+
+    if (map == NULL)
+        return;
+
+    munmap(map->base, map->size);
+    free(map->vars);
+    free(map);
+    file->map = NULL;
+}
@@ -0,0 +1,339 @@
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "ncwriter.h"
+#include "randw.h"
+#include "preprocess.h"
+
+/*
+ * Output of the reconstructed series. The file (NetCDF-4, so that every
+ * variable is chunked along time and optionally deflated) is created with
+ * the time coordinate of the prediction period; each reconstructed
+ * variable is then handed to a writer thread (ncwriter_submit) so that
+ * its definition and chunk writes overlap the processing of the next
+ * variable. With chunked prediction a variable arrives as several ranges,
+ * defined with the first one. Calls into libnetcdf are serialized on netcdf_lock, shared
+ * with the readers.
+ */
+
+/* mkdir -p */
+static bool make_dirs(const char *dir)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s", dir);
+    for (char *p = path + 1; *p; p++)
+    {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        if (mkdir(path, 0755) != 0 && errno != EEXIST)
+            return false;
+        *p = '/';
+    }
+
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+static void define_variable(NcWriter *writer, NcWriterJob *job, int *varid)
+{
+    handle_error(nc_redef(writer->ncid));
+    handle_error(nc_def_var(writer->ncid, job->name, job->type, 1, &writer->time_dimid, varid));
+    handle_error(nc_def_var_chunking(writer->ncid, *varid, NC_CHUNKED, &writer->chunk));
+    if (writer->deflate > 0)
+        handle_error(nc_def_var_deflate(writer->ncid, *varid, 1, 1, writer->deflate));
+    handle_error(nc_enddef(writer->ncid));
+}
+
+/* Written with the range that ends the period, when the RMSE is final */
+static void put_rmse(NcWriter *writer, NcWriterJob *job, int varid)
+{
+    pthread_mutex_lock(&netcdf_lock);
+    handle_error(nc_redef(writer->ncid));
+    handle_error(nc_put_att_double(writer->ncid, varid, "rmse", NC_DOUBLE, 1, &job->rmse));
+    handle_error(nc_enddef(writer->ncid));
+    pthread_mutex_unlock(&netcdf_lock);
+}
+
+/* One chunk per call, so readers can take the library in between */
+static void write_chunks(NcWriter *writer, int varid, const void *data, size_t elem_size,
+                         size_t first, size_t length)
+{
+    for (size_t done = 0; done < length; done += writer->chunk)
+    {
+        size_t start = first + done;
+        size_t count = length - done < writer->chunk ? length - done : writer->chunk;
+
+        pthread_mutex_lock(&netcdf_lock);
+        handle_error(nc_put_vara(writer->ncid, varid, &start, &count,
+                                 (const unsigned char *)data + done * elem_size));
+        pthread_mutex_unlock(&netcdf_lock);
+    }
+}
+
+static void *writer_worker(void *arg)
+{
+    NcWriter *writer = (NcWriter *)arg;
+
+    for (;;)
+    {
+        NcWriterJob *job;
+        int varid;
+
+        pthread_mutex_lock(&writer->lock);
+        while (!writer->head && !writer->done)
+            pthread_cond_wait(&writer->cond, &writer->lock);
+        job = writer->head;
+        if (job)
+        {
+            writer->head = job->next;
+            if (!writer->head)
+                writer->tail = NULL;
+        }
+        pthread_mutex_unlock(&writer->lock);
+
+        if (!job)
+            break; // done and drained
+
+        varid = writer->varids[job->n];
+        if (varid < 0)
+        {
+            pthread_mutex_lock(&netcdf_lock);
+            define_variable(writer, job, &varid);
+            pthread_mutex_unlock(&netcdf_lock);
+            writer->varids[job->n] = varid;
+        }
+
+        write_chunks(writer, varid, job->data, job->elem_size, job->start, job->count);
+        if (job->start + job->count == writer->length)
+            put_rmse(writer, job, varid);
+
+        free(job->data);
+        free(job);
+    }
+
+    return NULL;
+}
+
+/*
+ * Bytes per element of created_data. Only the types recreate_data
+ * reconstructs are written (0 = skipped: the buffer of any other type
+ * holds no reconstruction).
+ */
+static size_t elem_size(nc_type type)
+{
+    switch (type)
+    {
+    case NC_FLOAT:
+        return sizeof(TYPE_VAR_NC_FLOAT);
+    case NC_DOUBLE:
+        return sizeof(TYPE_VAR_NC_DOUBLE);
+    default:
+        return 0;
+    }
+}
+
+/* Time coordinate of the prediction period, as double */
+static void write_time(NcWriter *writer, NetCDF *file, DataSegment *ds, int varid)
+{
+    double *time = (double *)malloc(writer->length * sizeof(double));
+
+    if (!time)
+    {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        exit(1);
+    }
+
+    for (size_t j = 0; j < writer->length; j++)
+        time[j] = time_value(&file->var[0], ds->start_prediction + (int)j);
+
+    write_chunks(writer, varid, time, sizeof(double), 0, writer->length);
+    free(time);
+}
+
+/*
+ * Units and calendar of the time axis. A file loaded through mmap or from
+ * the preprocessed image has no libnetcdf handle, so the source is opened
+ * just for nc_copy_att. Called with netcdf_lock held.
+ */
+static void copy_time_attributes(NcWriter *writer, NetCDF *file, const char *source, int time_varid)
+{
+    bool reopen = file->map || file->cache;
+    int ncid = file->ncid_in;
+    int varid = file->var[0].id;
+    int natts;
+
+    if (reopen)
+    {
+        if (nc_open(source, NC_NOWRITE, &ncid) != NC_NOERR)
+        {
+            fprintf(stderr, "Warning: Failed to open %s, time attributes not written.\n", source);
+            return;
+        }
+        if (nc_inq_varid(ncid, file->var[0].name, &varid) != NC_NOERR)
+        {
+            fprintf(stderr, "Warning: %s not found in %s, time attributes not written.\n", file->var[0].name, source);
+            nc_close(ncid);
+            return;
+        }
+    }
+
+    handle_error(nc_inq_varnatts(ncid, varid, &natts));
+    for (int j = 0; j < natts; j++)
+    {
+        char att_name[NC_MAX_NAME + 1];
+        handle_error(nc_inq_attname(ncid, varid, j, att_name));
+        if (strcmp(att_name, "_FillValue") == 0)
+            continue; // Typed as the source axis, the output axis is double
+        handle_error(nc_copy_att(ncid, varid, att_name, writer->ncid, time_varid));
+    }
+
+    if (reopen)
+        handle_error(nc_close(ncid));
+}
+
+NcWriter *ncwriter_open(NetCDF *file, DataSegment *ds, char *source)
+{
+    const char *title = "Analog Ensemble reconstruction";
+    char path[PATH_MAX];
+    char date[20];
+    time_t t = time(NULL);
+    int time_varid;
+    NcWriter *writer;
+
+    if (!make_dirs(ds->output_dir))
+    {
+        fprintf(stderr, "Warning: Failed to create %s, output not written.\n", ds->output_dir);
+        return NULL;
+    }
+
+    writer = (NcWriter *)calloc(1, sizeof(NcWriter));
+    if (!writer)
+    {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        return NULL;
+    }
+
+    writer->length = (size_t)(ds->end_prediction - ds->start_prediction) + 1;
+    writer->chunk = ds->output_chunk > 0 ? (size_t)ds->output_chunk : NCWRITER_CHUNK;
+    if (writer->chunk > writer->length)
+        writer->chunk = writer->length;
+    writer->deflate = ds->output_deflate;
+    writer->varids = (int *)malloc(file->nvars * sizeof(int));
+    if (!writer->varids)
+    {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        exit(1);
+    }
+    for (int i = 0; i < file->nvars; i++)
+        writer->varids[i] = -1;
+
+    strftime(date, sizeof(date), "%Y%m%d%H%M%S", localtime(&t));
+    snprintf(path, sizeof(path), "%s/anen-%s-%d.nc", ds->output_dir, date, (int)getpid());
+
+    pthread_mutex_lock(&netcdf_lock);
+    handle_error(nc_create(path, NC_NETCDF4 | NC_CLOBBER, &writer->ncid));
+    handle_error(nc_put_att_text(writer->ncid, NC_GLOBAL, "title", strlen(title), title));
+    handle_error(nc_put_att_text(writer->ncid, NC_GLOBAL, "source", strlen(source), source));
+    handle_error(nc_put_att_int(writer->ncid, NC_GLOBAL, "k", NC_INT, 1, &ds->k));
+    handle_error(nc_put_att_int(writer->ncid, NC_GLOBAL, "num_Na", NC_INT, 1, &ds->num_Na));
+    handle_error(nc_def_dim(writer->ncid, file->dim->name, writer->length, &writer->time_dimid));
+    handle_error(nc_def_var(writer->ncid, file->var[0].name, NC_DOUBLE, 1, &writer->time_dimid, &time_varid));
+    handle_error(nc_def_var_chunking(writer->ncid, time_varid, NC_CHUNKED, &writer->chunk));
+
+    copy_time_attributes(writer, file, source, time_varid);
+    handle_error(nc_enddef(writer->ncid));
+    pthread_mutex_unlock(&netcdf_lock);
+
+    write_time(writer, file, ds, time_varid);
+
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->cond, NULL);
+    if (pthread_create(&writer->thread, NULL, writer_worker, writer) != 0)
+    {
+        fprintf(stderr, "Error: Failed to create writer thread.\n");
+        exit(1);
+    }
+
+    return writer;
+}
+
+/*
+ * Queue created_data of variable n, holding [start, start + count) of the
+ * prediction period, for writing. The buffer changes owner:
+ * var->created_data is cleared and the writer frees it. Ranges come in
+ * order; var->rmse must be final when the last one is queued.
+ */
+void ncwriter_submit_range(NcWriter *writer, NetCDF *file, int n, size_t start, size_t count)
+{
+    Variable *var = &file->var[n];
+    size_t size = elem_size(var->type);
+    NcWriterJob *job;
+
+    if (!writer || !var->created_data)
+        return;
+    if (size == 0)
+    {
+        fprintf(stderr, "Warning: %s is not float or double, not written.\n", var->name);
+        free(var->created_data);
+        var->created_data = NULL;
+        return;
+    }
+
+    job = (NcWriterJob *)calloc(1, sizeof(NcWriterJob));
+    if (!job)
+    {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        exit(1);
+    }
+
+    strcpy(job->name, var->name);
+    job->type = var->type;
+    job->elem_size = size;
+    job->data = var->created_data;
+    job->rmse = var->rmse;
+    job->n = n;
+    job->start = start;
+    job->count = count;
+    var->created_data = NULL;
+
+    pthread_mutex_lock(&writer->lock);
+    if (writer->tail)
+        writer->tail->next = job;
+    else
+        writer->head = job;
+    writer->tail = job;
+    pthread_cond_signal(&writer->cond);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+/* Queue the whole prediction period of variable n */
+void ncwriter_submit(NcWriter *writer, NetCDF *file, int n)
+{
+    if (writer)
+        ncwriter_submit_range(writer, file, n, 0, writer->length);
+}
+
+/* Drain the queue, stop the writer thread and close the file */
+void ncwriter_close(NcWriter *writer)
+{
+    if (!writer)
+        return;
+
+    pthread_mutex_lock(&writer->lock);
+    writer->done = true;
+    pthread_cond_signal(&writer->cond);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+
+    pthread_mutex_lock(&netcdf_lock);
+    handle_error(nc_close(writer->ncid));
+    pthread_mutex_unlock(&netcdf_lock);
+
+    pthread_cond_destroy(&writer->cond);
+    pthread_mutex_destroy(&writer->lock);
+    free(writer->varids);
+    free(writer);
+}
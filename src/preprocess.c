@@ -1,4 +1,5 @@
 #include <preprocess.h>
+#include "randw.h"
 
 time_t convert_time(char *rawtime)
 {
@@ -20,28 +21,204 @@ time_t convert_time(char *rawtime)
     return timegm(&time_info) / 60;
 }
 
-int binary_search(NetCDF *file, int target)
+static int compare_time_entry(const void *a, const void *b)
 {
-    int *values = file[0].var[0].data;
+    const TimeEntry *x = (const TimeEntry *)a;
+    const TimeEntry *y = (const TimeEntry *)b;
 
-    int init = 0, end = file[0].dim->len - 1;
+    if (x->time != y->time)
+        return x->time < y->time ? -1 : 1;
+    return x->index - y->index; // First occurrence wins, as in a scan
+}
+
+/*
+ * Index of the time axis as it is loaded now (any numeric type). Reading
+ * var[0] again (the slab after the whole axis) drops it, and
+ * find_time_index builds it on the next lookup.
+ */
+void build_time_index(NetCDF *file)
+{
+    Variable *var_zero = &file->var[0];
+    int len = file->dim->len;
+    TimeIndex *index;
+    bool regular = len > 1, increasing = true;
+
+    release_time_index(file);
 
-    while (init <= end)
+    index = (TimeIndex *)calloc(1, sizeof(TimeIndex));
+    if (!index)
     {
-        int middle = init + (end - init) / 2;
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    index->len = len;
 
-        if (values[middle] == target)
-            return middle;
+    if (len > 0)
+    {
+        index->first = time_value(var_zero, 0);
+        index->step = len > 1 ? time_value(var_zero, 1) - index->first : 0;
+        regular = regular && index->step > 0;
+    }
+
+    for (int j = 1; j < len && (regular || increasing); j++)
+    {
+        double prev = time_value(var_zero, j - 1);
+        double t = time_value(var_zero, j);
+
+        increasing = increasing && t > prev;
+        regular = regular && t - prev == index->step;
+    }
+
+    if (regular || len <= 1)
+        index->kind = TIME_REGULAR;
+    else if (increasing)
+        index->kind = TIME_INCREASING;
+    else
+    {
+        index->kind = TIME_SORTED;
+        index->sorted = (TimeEntry *)malloc(len * sizeof(TimeEntry));
+        if (!index->sorted)
+        {
+            fprintf(stderr, "Error: Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int j = 0; j < len; j++)
+        {
+            index->sorted[j].time = time_value(var_zero, j);
+            index->sorted[j].index = j;
+        }
+        qsort(index->sorted, len, sizeof(TimeEntry), compare_time_entry);
+    }
+
+    file->time_index = index;
+}
+
+void release_time_index(NetCDF *file)
+{
+    if (!file->time_index)
+        return;
+
+    free(file->time_index->sorted);
+    free(file->time_index);
+    file->time_index = NULL;
+}
 
-        if (values[middle] < target)
-            init = middle + 1;
-        else
-            end = middle - 1;
+/* Index of the sample at time t (exact match), or -1 */
+int find_time_index(NetCDF *file, double t)
+{
+    Variable *var_zero = &file->var[0];
+    TimeIndex *index;
+
+    if (!file->time_index)
+        build_time_index(file);
+    index = file->time_index;
+
+    if (index->len == 0)
+        return -1;
+
+    switch (index->kind)
+    {
+    case TIME_REGULAR:
+    {
+        double offset = index->len > 1 ? (t - index->first) / index->step : 0;
+        int j;
+
+        if (!(offset > -0.5 && offset < index->len - 0.5))
+            return -1;
+        j = (int)llround(offset);
+        return time_value(var_zero, j) == t ? j : -1;
+    }
+    case TIME_INCREASING:
+    {
+        int init = 0, end = index->len - 1;
+
+        while (init <= end)
+        {
+            int middle = init + (end - init) / 2;
+            double value = time_value(var_zero, middle);
+
+            if (value == t)
+                return middle;
+
+            if (value < t)
+                init = middle + 1;
+            else
+                end = middle - 1;
+        }
+        return -1;
+    }
+    case TIME_SORTED:
+    {
+        int init = 0, end = index->len - 1, found = -1;
+
+        /* Leftmost match: the first occurrence of t */
+        while (init <= end)
+        {
+            int middle = init + (end - init) / 2;
+
+            if (index->sorted[middle].time < t)
+                init = middle + 1;
+            else
+            {
+                if (index->sorted[middle].time == t)
+                    found = index->sorted[middle].index;
+                end = middle - 1;
+            }
+        }
+        return found;
+    }
     }
 
     return -1;
 }
 
+/*
+ * Value j of the time axis in its own type (the interpolation used to read
+ * it with the type of the interpolated variable, which runs past the end of
+ * an int axis for 8-byte variables).
+ */
+double time_value(Variable *var_zero, int j)
+{
+    switch (var_zero->type)
+    {
+    case NC_SHORT:
+        return ((short *)var_zero->data)[j];
+    case NC_INT:
+        return ((int *)var_zero->data)[j];
+    case NC_FLOAT:
+        return ((float *)var_zero->data)[j];
+    case NC_DOUBLE:
+        return ((double *)var_zero->data)[j];
+    case NC_UINT:
+        return ((unsigned int *)var_zero->data)[j];
+    case NC_INT64:
+        return ((long long *)var_zero->data)[j];
+    case NC_UINT64:
+        return ((unsigned long long *)var_zero->data)[j];
+    default:
+        fprintf(stderr, "Tipo não suportado: %i", var_zero->type);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Resolve the period bounds of ds (time_*) into indices of the time axis
+ * of the first file. Training windows start k samples after the period
+ * start and prediction windows end k samples before the period end.
+ */
+void set_periods(NetCDF *file, DataSegment *ds)
+{
+    ds->start_training = find_time_index(file, ds->time_start_training);
+    ds->end_training = find_time_index(file, ds->time_end_training);
+    ds->start_prediction = find_time_index(file, ds->time_start_prediction);
+    ds->end_prediction = find_time_index(file, ds->time_end_prediction);
+
+    if (ds->start_training >= 0)
+        ds->start_training += ds->k;
+    if (ds->end_prediction >= 0)
+        ds->end_prediction -= ds->k;
+}
+
 void analyze_data(NetCDF *file, DataSegment *ds, process_func func)
 {
     for (int i = 0; i < (ds->argc); i++)
@@ -106,39 +283,55 @@ void print_data_values(NetCDF *file, DataSegment *ds)
     }
 }
 
-void count_invalid_values(NetCDF *file, DataSegment *ds)
+/* Invalid values in [start, end), turning VALUE_ERR into NaN */
+int count_invalid_range(Variable *var, int start, int end)
 {
-    Variable *var = NULL;
+    int invalid_count = 0;
 
-    for (int i = 1; i < file->nvars; i++)
+    switch (var->type)
+    {
+        VALIDATE_DATA(NC_BYTE);
+        VALIDATE_DATA(NC_CHAR);
+        VALIDATE_DATA(NC_SHORT);
+        VALIDATE_DATA(NC_INT);
+        VALIDATE_DATA(NC_FLOAT);
+        VALIDATE_DATA(NC_DOUBLE);
+        VALIDATE_DATA(NC_UBYTE);
+        VALIDATE_DATA(NC_USHORT);
+        VALIDATE_DATA(NC_UINT);
+        VALIDATE_DATA(NC_INT64);
+        VALIDATE_DATA(NC_UINT64);
+    default:
     {
-        int invalid_count = 0;
+        fprintf(stderr, "Tipo não suportado: %i", var->type);
+        exit(EXIT_FAILURE);
+    }
+    break;
+    }
 
-        var = &file->var[i];
-        switch (var->type)
-        {
-            VALIDATE_DATA(NC_BYTE);
-            VALIDATE_DATA(NC_CHAR);
-            VALIDATE_DATA(NC_SHORT);
-            VALIDATE_DATA(NC_INT);
-            VALIDATE_DATA(NC_FLOAT);
-            VALIDATE_DATA(NC_DOUBLE);
-            VALIDATE_DATA(NC_UBYTE);
-            VALIDATE_DATA(NC_USHORT);
-            VALIDATE_DATA(NC_UINT);
-            VALIDATE_DATA(NC_INT64);
-            VALIDATE_DATA(NC_UINT64);
-        default:
-        {
-            fprintf(stderr, "Tipo não suportado: %i", var->type);
-            exit(EXIT_FAILURE);
-        }
-        break;
-        }
+    return invalid_count;
+}
 
-        var->invalid_count = invalid_count;
+static void set_invalid_count(NetCDF *file, Variable *var, int invalid_count)
+{
+    var->invalid_count = invalid_count;
+
+    var->invalid_percentage = 100 - (((double)(file->dim->len - invalid_count) / file->dim->len) * 100);
+}
+
+void count_invalid_variable(NetCDF *file, DataSegment *ds, int i)
+{
+    Variable *var = &file->var[i];
+
+    set_invalid_count(file, var, count_invalid_range(var, 0, file->dim->len));
+}
 
-        var->invalid_percentage = 100 - (((double)(file->dim->len - invalid_count) / file->dim->len) * 100);
+void count_invalid_values(NetCDF *file, DataSegment *ds)
+{
+    for (int i = 1; i < file->nvars; i++)
+    {
+        acquire_variable(file, i);
+        count_invalid_variable(file, ds, i);
     }
 }
 
@@ -149,206 +342,387 @@ void print_info_percentage(NetCDF *file, DataSegment *ds)
                ds->indice_generic, file->var[i].invalid_count, file->var[i].invalid_percentage);
 }
 
-void interpolation_values(NetCDF *file, DataSegment *ds)
+/* Times of samples [first, first + n) of the axis, with one branch on its type */
+static void load_times(Variable *var_zero, int first, int n, double *times)
 {
-    Variable *var_zero = NULL;
-    Variable *var = NULL;
-    int d_changes = 0;
-    double d_time[2] = {0, 0};
-    double d_interp[2] = {0, 0};
-    int d_index[2] = {0, 0};
+    switch (var_zero->type)
+    {
+        LOAD_TIMES(NC_SHORT);
+        LOAD_TIMES(NC_INT);
+        LOAD_TIMES(NC_FLOAT);
+        LOAD_TIMES(NC_DOUBLE);
+        LOAD_TIMES(NC_UINT);
+        LOAD_TIMES(NC_INT64);
+        LOAD_TIMES(NC_UINT64);
+    default:
+        fprintf(stderr, "Tipo não suportado: %i", var_zero->type);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Scan [start, end) of variable i filling gaps of up to
+ * win_size_interpolation values, continuing from (and updating) state.
+ * A gap is only filled once the valid sample after it is scanned.
+ */
+void interpolation_range(NetCDF *file, DataSegment *ds, int i, InterpState *state, int start, int end)
+{
+    Variable *var_zero = &file->var[0];
+    Variable *var = &file->var[i];
+    bool in_run = state->in_run;
+    bool has_left = state->has_left;
+    int run_start = state->run_start;
+    double left_value = state->left_value;
+    int d_filled = state->d_filled;
+    double times[ds->win_size_interpolation + 2];
+
+    switch (var->type)
+    {
+        FILL_GAPS(NC_FLOAT);
+        FILL_GAPS(NC_DOUBLE);
+    default:
+        /*
+         * Integer columns cannot hold NaN: count_invalid_range stores their
+         * invalid values as a sentinel, which the validity index excludes.
+         * They have no gaps to fill.
+         */
+        return;
+    }
+
+    state->in_run = in_run;
+    state->has_left = has_left;
+    state->run_start = run_start;
+    state->left_value = left_value;
+    state->d_filled = d_filled;
+}
 
-    // Initialize the interpolation objects
-    gsl_interp_accel *acc = gsl_interp_accel_alloc();
-    gsl_interp *interp = gsl_interp_alloc(gsl_interp_linear, 2);
+/*
+ * The predicted file (ds->indice_generic == 0) is interpolated only
+ * before the prediction period; the predictors up to its last window.
+ */
+static int interpolation_limit(NetCDF *file, DataSegment *ds)
+{
+    int limit = ds->indice_generic == 0 ? ds->start_prediction : ds->end_prediction + ds->k;
 
-    var_zero = &file->var[0];
+    return limit < (int)file->dim->len ? limit : (int)file->dim->len;
+}
 
-    // printf("file: %i\n", ds->indice_generic);
+static bool interpolation_gate(Variable *var)
+{
+    return (int)var->invalid_percentage != 0 && (int)var->invalid_percentage != 100;
+}
+
+void interpolation_variable(NetCDF *file, DataSegment *ds, int i)
+{
+    InterpState state = {0};
+
+    // printf("file: %i | var: %i\n", ds->indice_generic, i);
+    if (interpolation_gate(&file->var[i]))
+        interpolation_range(file, ds, i, &state, 0, interpolation_limit(file, ds));
+}
+
+void interpolation_values(NetCDF *file, DataSegment *ds)
+{
     for (int i = 1; i < file->nvars; i++)
     {
-        // printf("var: %i | ", i);
+        acquire_variable(file, i);
+        interpolation_variable(file, ds, i);
+    }
+}
 
-        var = &file->var[i];
-        int count = 0;
-        if ((int)var->invalid_percentage != 0 && (int)var->invalid_percentage != 100)
-        {
-            if (ds->indice_generic == 0)
-                for (int j = 0; j < ds->start_prediction; j++)
-                {
-                    switch (var->type)
-                    {
-                        IF_ISNAN(NC_BYTE);
-                        IF_ISNAN(NC_CHAR);
-                        IF_ISNAN(NC_SHORT);
-                        IF_ISNAN(NC_INT);
-                        IF_ISNAN(NC_FLOAT);
-                        IF_ISNAN(NC_DOUBLE);
-                        IF_ISNAN(NC_UBYTE);
-                        IF_ISNAN(NC_USHORT);
-                        IF_ISNAN(NC_UINT);
-                        IF_ISNAN(NC_INT64);
-                        IF_ISNAN(NC_UINT64);
-                    }
-                    if (d_time[1] && (d_time[0] < d_time[1]))
-                        switch (var->type)
-                        {
-                            INTERP_DATA(NC_BYTE);
-                            INTERP_DATA(NC_CHAR);
-                            INTERP_DATA(NC_SHORT);
-                            INTERP_DATA(NC_INT);
-                            INTERP_DATA(NC_FLOAT);
-                            INTERP_DATA(NC_DOUBLE);
-                            INTERP_DATA(NC_UBYTE);
-                            INTERP_DATA(NC_USHORT);
-                            INTERP_DATA(NC_UINT);
-                            INTERP_DATA(NC_INT64);
-                            INTERP_DATA(NC_UINT64);
-                        }
-                }
-            else
-            {
-                for (int j = 0; j < ds->start_prediction; j++)
-                {
-                    switch (var->type)
-                    {
-                        IF_ISNAN(NC_BYTE);
-                        IF_ISNAN(NC_CHAR);
-                        IF_ISNAN(NC_SHORT);
-                        IF_ISNAN(NC_INT);
-                        IF_ISNAN(NC_FLOAT);
-                        IF_ISNAN(NC_DOUBLE);
-                        IF_ISNAN(NC_UBYTE);
-                        IF_ISNAN(NC_USHORT);
-                        IF_ISNAN(NC_UINT);
-                        IF_ISNAN(NC_INT64);
-                        IF_ISNAN(NC_UINT64);
-                    }
-                    if (d_time[1] && (d_time[0] < d_time[1]))
-                        switch (var->type)
-                        {
-                            INTERP_DATA(NC_BYTE);
-                            INTERP_DATA(NC_CHAR);
-                            INTERP_DATA(NC_SHORT);
-                            INTERP_DATA(NC_INT);
-                            INTERP_DATA(NC_FLOAT);
-                            INTERP_DATA(NC_DOUBLE);
-                            INTERP_DATA(NC_UBYTE);
-                            INTERP_DATA(NC_USHORT);
-                            INTERP_DATA(NC_UINT);
-                            INTERP_DATA(NC_INT64);
-                            INTERP_DATA(NC_UINT64);
-                        }
-                }
-                for (int j = ds->start_prediction; j < ds->end_prediction + ds->k; j++)
-                {
-                    switch (var->type)
-                    {
-                        IF_ISNAN(NC_BYTE);
-                        IF_ISNAN(NC_CHAR);
-                        IF_ISNAN(NC_SHORT);
-                        IF_ISNAN(NC_INT);
-                        IF_ISNAN(NC_FLOAT);
-                        IF_ISNAN(NC_DOUBLE);
-                        IF_ISNAN(NC_UBYTE);
-                        IF_ISNAN(NC_USHORT);
-                        IF_ISNAN(NC_UINT);
-                        IF_ISNAN(NC_INT64);
-                        IF_ISNAN(NC_UINT64);
-                    }
-                    if (d_time[1] && (d_time[0] < d_time[1]))
-                        switch (var->type)
-                        {
-                            INTERP_DATA(NC_BYTE);
-                            INTERP_DATA(NC_CHAR);
-                            INTERP_DATA(NC_SHORT);
-                            INTERP_DATA(NC_INT);
-                            INTERP_DATA(NC_FLOAT);
-                            INTERP_DATA(NC_DOUBLE);
-                            INTERP_DATA(NC_UBYTE);
-                            INTERP_DATA(NC_USHORT);
-                            INTERP_DATA(NC_UINT);
-                            INTERP_DATA(NC_INT64);
-                            INTERP_DATA(NC_UINT64);
-                        }
-                }
-            }
-            d_changes = 0;
-            continue;
-        }
+/* Windows centred in [start, end] without invalid values */
+int count_valid_window_range(Variable *var, DataSegment *ds, int start, int end)
+{
+    int num_isvalid = 0;
+
+    switch (var->type)
+    {
+        COUNT_VALID_WIN(NC_BYTE);
+        COUNT_VALID_WIN(NC_CHAR);
+        COUNT_VALID_WIN(NC_SHORT);
+        COUNT_VALID_WIN(NC_INT);
+        COUNT_VALID_WIN(NC_FLOAT);
+        COUNT_VALID_WIN(NC_DOUBLE);
+        COUNT_VALID_WIN(NC_UBYTE);
+        COUNT_VALID_WIN(NC_USHORT);
+        COUNT_VALID_WIN(NC_UINT);
+        COUNT_VALID_WIN(NC_INT64);
+        COUNT_VALID_WIN(NC_UINT64);
+    default:
+    {
+        fprintf(stderr, "Tipo não suportado: %i", var->type);
+        exit(EXIT_FAILURE);
+    }
+    break;
     }
 
-    // Free resource
-    gsl_interp_free(interp);
-    gsl_interp_accel_free(acc);
+    return num_isvalid;
 }
 
-void count_valid_window(NetCDF *file, DataSegment *ds)
+void count_valid_window_variable(NetCDF *file, DataSegment *ds, int i)
 {
-    Variable *var = NULL;
+    Variable *var = &file->var[i];
 
-    int invalid_count = 0;
-    int num_isvalid = 0;
-    int start = 0;
-    int end = 0;
+    /* ------------------ Training ------------------ */
+    var->num_win_valid_training = count_valid_window_range(var, ds, ds->start_training, ds->end_training);
+
+    /* ----------------- Prediction ----------------- */
+    var->num_win_valid_prediction = count_valid_window_range(var, ds, ds->start_prediction, ds->end_prediction);
+}
 
+void count_valid_window(NetCDF *file, DataSegment *ds)
+{
     for (int i = 1; i < file->nvars; i++)
     {
-        var = &file->var[i];
+        acquire_variable(file, i);
+        count_valid_window_variable(file, ds, i);
+    }
+}
 
-        /* ------------------ Training ------------------ */
-        start = ds->start_training;
-        end = ds->end_training;
+/*
+ * Validity index of variable i: bit c of var->valid_windows is set when
+ * the window centred at c holds no invalid value. The centres in
+ * [start, end] are (re)marked from a prefix count of the invalid samples
+ * under them, so each window costs one subtraction instead of a scan of
+ * win_size values. The prefix only lives during the call; the bitmap
+ * (len / 8 bytes) stays until release_valid_windows.
+ */
+void index_valid_windows(NetCDF *file, DataSegment *ds, int i, int start, int end)
+{
+    Variable *var = &file->var[i];
+    int len = file->dim->len;
+    int lo, hi;
+    int *prefix;
 
-        switch (var->type)
-        {
-            COUNT_VALID_WIN(NC_BYTE);
-            COUNT_VALID_WIN(NC_CHAR);
-            COUNT_VALID_WIN(NC_SHORT);
-            COUNT_VALID_WIN(NC_INT);
-            COUNT_VALID_WIN(NC_FLOAT);
-            COUNT_VALID_WIN(NC_DOUBLE);
-            COUNT_VALID_WIN(NC_UBYTE);
-            COUNT_VALID_WIN(NC_USHORT);
-            COUNT_VALID_WIN(NC_UINT);
-            COUNT_VALID_WIN(NC_INT64);
-            COUNT_VALID_WIN(NC_UINT64);
-        default:
+    if (!var->valid_windows)
+    {
+        var->valid_windows = (uint64_t *)calloc((len + 63) / 64, sizeof(uint64_t));
+        if (!var->valid_windows)
         {
-            fprintf(stderr, "Tipo não suportado: %i", var->type);
+            fprintf(stderr, "Error: Memory allocation failed.\n");
             exit(EXIT_FAILURE);
         }
+    }
+
+    start = start > 0 ? start : 0;
+    end = end < len - 1 ? end : len - 1;
+    if (start > end)
+        return;
+
+    lo = start - ds->k > 0 ? start - ds->k : 0;
+    hi = end + ds->k + 1 < len ? end + ds->k + 1 : len;
+    prefix = (int *)malloc((hi - lo + 1) * sizeof(int));
+    if (!prefix)
+    {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    prefix[0] = 0;
+    switch (var->type)
+    {
+        PREFIX_INVALID(NC_SHORT, values[p] == (short)VALUE_NAN);
+        PREFIX_INVALID(NC_INT, values[p] == (int)VALUE_NAN);
+        PREFIX_INVALID(NC_FLOAT, isnan(values[p]));
+        PREFIX_INVALID(NC_DOUBLE, isnan(values[p]));
+    default:
+        /* validate_window_simple takes the other types as valid */
+        for (int p = lo; p < hi; p++)
+            prefix[p - lo + 1] = 0;
         break;
-        }
+    }
+
+    for (int c = start; c <= end; c++)
+    {
+        uint64_t valid = c - ds->k >= 0 && c + ds->k < len &&
+                         prefix[c + ds->k + 1 - lo] == prefix[c - ds->k - lo];
+        uint64_t *word = &var->valid_windows[c >> 6];
 
-        var->num_win_valid_training = num_isvalid;
+        *word = (*word & ~(1ULL << (c & 63))) | (valid << (c & 63));
+    }
 
-        /* ----------------- Prediction ----------------- */
-        start = ds->start_prediction;
-        end = ds->end_prediction;
-        num_isvalid = 0;
+    free(prefix);
+}
 
-        switch (var->type)
-        {
-            COUNT_VALID_WIN(NC_BYTE);
-            COUNT_VALID_WIN(NC_CHAR);
-            COUNT_VALID_WIN(NC_SHORT);
-            COUNT_VALID_WIN(NC_INT);
-            COUNT_VALID_WIN(NC_FLOAT);
-            COUNT_VALID_WIN(NC_DOUBLE);
-            COUNT_VALID_WIN(NC_UBYTE);
-            COUNT_VALID_WIN(NC_USHORT);
-            COUNT_VALID_WIN(NC_UINT);
-            COUNT_VALID_WIN(NC_INT64);
-            COUNT_VALID_WIN(NC_UINT64);
-        default:
+/*
+ * Centres in [start, end] whose window is valid in variable i of every
+ * file in [first, last), in ascending order: the bitmaps are ANDed a
+ * word at a time. Returns how many were written to indices.
+ */
+int collect_valid_windows(NetCDF *file, int first, int last, int i, int start, int end, int *indices)
+{
+    int count = 0;
+
+    if (start > end)
+        return 0;
+
+    for (int f = first; f < last; f++)
+        if (!file[f].var[i].valid_windows)
+            return 0;
+
+    for (int w = start >> 6; w <= end >> 6; w++)
+    {
+        uint64_t word = ~0ULL;
+
+        for (int f = first; f < last; f++)
+            word &= file[f].var[i].valid_windows[w];
+        if (w == start >> 6)
+            word &= ~0ULL << (start & 63);
+        if (w == end >> 6)
+            word &= ~0ULL >> (63 - (end & 63));
+
+        while (word)
         {
-            fprintf(stderr, "Tipo não suportado: %i", var->type);
-            exit(EXIT_FAILURE);
-        }
-        break;
+            indices[count++] = (w << 6) + __builtin_ctzll(word);
+            word &= word - 1;
         }
+    }
+
+    return count;
+}
+
+void release_valid_windows(Variable *var)
+{
+    free(var->valid_windows);
+    var->valid_windows = NULL;
+}
+
+/*
+ * Full preprocessing of variable i of one file, loading it first if
+ * needed; ds->indice_generic must hold the index of the file. Same result
+ * as count_invalid, interpolation, count_invalid and count_valid_window in
+ * a row, in fewer passes: the whole variable is scanned once to replace
+ * VALUE_ERR and count invalid values (the count gates the interpolation),
+ * then once by the interpolation if it applies. The recount is the first
+ * count minus the values filled, and valid windows are counted only over
+ * the periods, in a single pass each. Ends with the validity index.
+ */
+void preprocess_variable(NetCDF *file, DataSegment *ds, int i)
+{
+    Variable *var = &file->var[i];
+    InterpState state = {0};
+
+    acquire_variable(file, i);
+
+    if (var->ready)
+        return;
+
+    int invalid_count = count_invalid_range(var, 0, file->dim->len);
+    set_invalid_count(file, var, invalid_count);
+
+    if (interpolation_gate(var))
+        interpolation_range(file, ds, i, &state, 0, interpolation_limit(file, ds));
+
+    /* Interpolation only fills invalid values */
+    set_invalid_count(file, var, invalid_count - state.d_filled);
+    count_valid_window_variable(file, ds, i);
+    index_valid_windows(file, ds, i, 0, file->dim->len - 1);
+
+    var->ready = true;
+}
+
+/*
+ * Chunked counterpart of preprocess_variable: variable i is read into a
+ * reserved column, kept up to start_prediction and preprocessed there.
+ * The rest of the slab is only streamed once, chunk by chunk, to count
+ * its invalid values, so that invalid_percentage (the interpolation gate
+ * and the selection of the variable) is the one of the whole slab; it is
+ * loaded again by preprocess_chunk.
+ */
+void preprocess_variable_chunked(NetCDF *file, DataSegment *ds, int i)
+{
+    Variable *var = &file->var[i];
+    int len = file->dim->len;
+    int resident = ds->start_prediction < len ? ds->start_prediction : len;
+    ChunkStream *stream;
+
+    if (var->ready)
+        return;
+
+    reserve_variable(file, i);
+    read_variable_range(file, i, 0, resident);
+    int invalid_count = count_invalid_range(var, 0, resident);
+    size_t dropped = resident;
+
+    for (int start = resident; start < len; start += ds->prediction_chunk)
+    {
+        int end = start + ds->prediction_chunk < len ? start + ds->prediction_chunk : len;
+
+        read_variable_range(file, i, start, end - start);
+        invalid_count += count_invalid_range(var, start, end);
+        dropped = drop_variable_range(file, i, dropped, end);
+    }
+    set_invalid_count(file, var, invalid_count);
+
+    stream = (ChunkStream *)calloc(1, sizeof(ChunkStream));
+    if (!stream)
+    {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    stream->interpolate = interpolation_gate(var);
+    stream->limit = interpolation_limit(file, ds);
+    stream->loaded = resident;
+    stream->scanned = resident < stream->limit ? resident : stream->limit;
+    stream->dropped = resident;
+    stream->invalid_raw = invalid_count;
+    var->stream = stream;
+
+    if (stream->interpolate)
+        interpolation_range(file, ds, i, &stream->interp, 0, stream->scanned);
+
+    /* Interpolation only fills invalid values */
+    set_invalid_count(file, var, stream->invalid_raw - stream->interp.d_filled);
+    var->num_win_valid_training = count_valid_window_range(var, ds, ds->start_training, ds->end_training);
+    var->num_win_valid_prediction = 0;
+    index_valid_windows(file, ds, i, 0, resident - 1 - ds->k);
+
+    var->ready = true;
+}
+
+/*
+ * Make the windows centred in [start, end] of the chunked variable i
+ * usable: load up to the halo past end and carry the interpolation over
+ * it (a gap ending beyond the halo is too long to be filled anyway).
+ */
+void preprocess_chunk(NetCDF *file, DataSegment *ds, int i, int start, int end)
+{
+    Variable *var = &file->var[i];
+    ChunkStream *stream = var->stream;
+    int halo = ds->k + ds->win_size_interpolation + 1;
+    int len = file->dim->len;
+    int need = end + halo + 1 < len ? end + halo + 1 : len;
+    int scan = need < stream->limit ? need : stream->limit;
+
+    if (need > stream->loaded)
+    {
+        read_variable_range(file, i, stream->loaded, need - stream->loaded);
+        count_invalid_range(var, stream->loaded, need);
+        stream->loaded = need;
+    }
 
-        var->num_win_valid_prediction = num_isvalid;
+    if (scan > stream->scanned)
+    {
+        if (stream->interpolate)
+            interpolation_range(file, ds, i, &stream->interp, stream->scanned, scan);
+        stream->scanned = scan;
     }
-}
\ No newline at end of file
+
+    set_invalid_count(file, var, stream->invalid_raw - stream->interp.d_filled);
+    var->num_win_valid_prediction += count_valid_window_range(var, ds, start, end);
+    index_valid_windows(file, ds, i, start, end);
+}
+
+/*
+ * Give back the chunked variable i below the windows of the chunk that
+ * starts at next, keeping the halo the interpolation may still write.
+ */
+void release_chunk(NetCDF *file, DataSegment *ds, int i, int next)
+{
+    ChunkStream *stream = file->var[i].stream;
+    int halo = ds->k + ds->win_size_interpolation + 1;
+    int end = next - halo < stream->loaded ? next - halo : stream->loaded;
+
+    if (end > stream->dropped)
+        stream->dropped = (int)drop_variable_range(file, i, stream->dropped, end);
+}
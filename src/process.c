@@ -1,6 +1,10 @@
 #include "process.h"
 #include "randw.h"
+#include "preprocess.h"
 #include "kdtree.h"
+#include "ncwriter.h"
+
+#include <gsl/gsl_blas.h>
 
 // =============================================================================
 // IMPLEMENTACAO DAS FUNCOES AUXILIARES BASICAS
@@ -11,6 +15,8 @@
  *
  * Verifica se todos os valores em uma janela centrada na posição
  * especificada são válidos (não NaN). Suporta múltiplos tipos de dados.
+ * Com o índice de validade da variável (index_valid_windows), é um
+ * teste de bit.
  */
 bool validate_window_simple(Variable *var, int position, int k, int win_size, int data_length)
 {
@@ -22,6 +28,9 @@ bool validate_window_simple(Variable *var, int position, int k, int win_size, in
         return false;
     }
 
+    if (var->valid_windows && win_size == 2 * k + 1)
+        return window_is_valid(var, position);
+
     // Validação da janela completa baseada no tipo
     switch (var->type)
     {
@@ -81,6 +90,23 @@ bool validate_window_simple(Variable *var, int position, int k, int win_size, in
     return true;
 }
 
+/**
+ * @brief Verifica se a predição em blocos (ds->prediction_chunk) se aplica
+ *
+ * Exige kdanen_dependent_parallel, variáveis carregadas sob demanda (sem
+ * cache nem carregamento completo) e o treino inteiro, com o halo,
+ * antes do período de predição: só a parte anterior a start_prediction
+ * fica residente.
+ */
+static bool chunked_prediction_supported(NetCDF *file, DataSegment *ds, process_func func)
+{
+    int halo = ds->k + ds->win_size_interpolation + 1;
+
+    return func == kdanen_dependent_parallel &&
+           ds->lazy_load && !ds->load_all && !file->cache &&
+           ds->argc > 1 && ds->end_training + halo < ds->start_prediction;
+}
+
 /**
  * @brief Função de processamento genérica
  *
@@ -97,34 +123,219 @@ void processing_data(NetCDF *file, DataSegment *ds, process_func func)
             return;
         }
     }
+
+    if (ds->prediction_chunk > 0 && !chunked_prediction_supported(file, ds, func))
+    {
+        fprintf(stderr, "Aviso: predição em blocos indisponível nesta configuração, usando o período inteiro.\n");
+        ds->prediction_chunk = 0;
+    }
+
     func(file, ds); // Call the processing function
+    wait_prefetch_variable(ds);
 }
 
 /**
- * @brief Cálculo da métrica de distância Monache
+ * @brief Argumentos da thread de pré-carregamento
  *
- * Implementa distância euclidiana entre duas janelas de dados
- * com suporte a múltiplos tipos de dados.
+ * A thread trabalha sobre uma cópia de DataSegment, pois
+ * indice_generic é alterado a cada arquivo pré-processado.
  */
-double monache_metric(Variable *var, DataSegment *ds, int forecast, int analog, int i)
+typedef struct
 {
-    double sum = 0.0;
+    NetCDF *file;
+    DataSegment ds;
+    int n;
+} PrefetchData;
+
+/**
+ * @brief Pré-processa a variável n do arquivo predito e, se selecionada,
+ * das séries preditoras
+ *
+ * As séries preditoras são distribuídas entre ds->num_thread threads
+ * (parallel_file_variables), como a busca.
+ */
+static void preprocess_processing_variable(NetCDF *file, DataSegment *ds, int n)
+{
+    // Predição em blocos: só o treino fica carregado (preprocess_chunk)
+    variable_func preprocess = ds->prediction_chunk > 0 ? preprocess_variable_chunked : preprocess_variable;
+
+    ds->indice_generic = 0;
+    preprocess(&file[0], ds, n);
+
+    if (file[0].var[n].invalid_percentage > (double)15 ||
+        file[0].var[n].invalid_percentage == (double)0)
+        return;
+
+    parallel_file_variables(file, ds, 1, ds->argc, n, n + 1, preprocess, ds->num_thread);
+}
+
+static void *prefetch_worker(void *arg)
+{
+    PrefetchData *data = (PrefetchData *)arg;
+
+    preprocess_processing_variable(data->file, &data->ds, data->n);
+    free(data);
+
+    return NULL;
+}
+
+/**
+ * @brief Aguarda a thread de pré-carregamento, se houver
+ */
+void wait_prefetch_variable(DataSegment *ds)
+{
+    if (!ds->prefetching)
+        return;
+
+    pthread_join(ds->prefetch_thread, NULL);
+    ds->prefetching = false;
+}
+
+/**
+ * @brief Inicia o carregamento da variável n em segundo plano
+ *
+ * Sem sucesso na criação da thread, a variável é carregada
+ * normalmente quando o algoritmo chegar nela.
+ */
+static void start_prefetch_variable(NetCDF *file, DataSegment *ds, int n)
+{
+    PrefetchData *data = (PrefetchData *)malloc(sizeof(PrefetchData));
 
+    if (!data)
+        return;
+
+    data->file = file;
+    data->ds = *ds;
+    data->n = n;
+
+    if (pthread_create(&ds->prefetch_thread, NULL, prefetch_worker, data) != 0)
+    {
+        free(data);
+        return;
+    }
+    ds->prefetching = true;
+}
+
+/**
+ * @brief Carrega e pré-processa a variável n sob demanda
+ *
+ * O arquivo predito é sempre pré-processado (o percentual de inválidos
+ * decide a seleção); as séries preditoras só quando a variável é
+ * selecionada pelos algoritmos. Com ds->prefetch, a variável n+1 é
+ * carregada em segundo plano enquanto o algoritmo processa a n.
+ */
+void acquire_processing_variable(NetCDF *file, DataSegment *ds, int n)
+{
+    if (ds->lazy_load)
+    {
+        // Normalmente a própria variável n, iniciada na iteração anterior
+        wait_prefetch_variable(ds);
+
+        preprocess_processing_variable(file, ds, n);
+
+        // Mesmo limite dos laços dos algoritmos
+        if (ds->prefetch && n < file[0].nvars - 13)
+            start_prefetch_variable(file, ds, n + 1);
+    }
+
+    // Variáveis já prontas no carregamento (cache, "serve") chegam sem o índice de validade
+    for (int f = 0; f < ds->argc; f++)
+        if (file[f].var[n].data && !file[f].var[n].valid_windows)
+            index_valid_windows(&file[f], ds, n, 0, file[f].dim->len - 1);
+}
+
+/**
+ * @brief Libera a variável n de todos os arquivos
+ *
+ * A série reconstruída segue para a thread de escrita (ds->writer), e
+ * os dados de entrada são liberados. Mantém o pico de memória limitado
+ * às variáveis em processamento.
+ */
+void release_processing_variable(NetCDF *file, DataSegment *ds, int n)
+{
+    ncwriter_submit(ds->writer, &file[0], n);
+
+    for (int f = 0; f < ds->argc; f++)
+        release_valid_windows(&file[f].var[n]);
+
+    if (!ds->lazy_load)
+        return;
+
+    for (int f = 0; f < ds->argc; f++)
+        release_variable(&file[f], n);
+}
+
+/**
+ * @brief Libera a variável n após uma saída antecipada do algoritmo
+ *
+ * A série reconstruída, incompleta, é descartada em vez de seguir para
+ * a escrita; o restante é o mesmo de release_processing_variable.
+ */
+static void discard_processing_variable(NetCDF *file, DataSegment *ds, int n)
+{
+    free(file[0].var[n].created_data);
+    file[0].var[n].created_data = NULL;
+    file[0].var[n].rmse = NAN;
+
+    release_processing_variable(file, ds, n);
+}
+
+/**
+ * @brief Aloca created_data da variável n no tipo do arquivo predito
+ *
+ * O mesmo tipo com que recreate_data preenche e ncwriter_submit grava.
+ * NC_FLOAT e NC_DOUBLE começam em NaN; os demais tipos, que
+ * recreate_data não reconstrói, em zero.
+ */
+static bool allocate_created_data(NetCDF *predicted_file, int n, unsigned int length)
+{
+    Variable *var = &predicted_file->var[n];
+
+    var->created_data = NULL;
     switch (var->type)
     {
-        MONACHE(NC_BYTE);
-        MONACHE(NC_CHAR);
-        MONACHE(NC_SHORT);
-        MONACHE(NC_INT);
-        MONACHE(NC_FLOAT);
-        MONACHE(NC_DOUBLE);
-        MONACHE(NC_UBYTE);
-        MONACHE(NC_USHORT);
-        MONACHE(NC_UINT);
-        MONACHE(NC_INT64);
-        MONACHE(NC_UINT64);
+        ALLOCATE_MEMORY_REC_DATA(NC_BYTE, length);
+        ALLOCATE_MEMORY_REC_DATA(NC_CHAR, length);
+        ALLOCATE_MEMORY_REC_DATA(NC_SHORT, length);
+        ALLOCATE_MEMORY_REC_DATA(NC_INT, length);
+        ALLOCATE_MEMORY_REC_DATA(NC_FLOAT, length);
+        ALLOCATE_MEMORY_REC_DATA(NC_DOUBLE, length);
+        ALLOCATE_MEMORY_REC_DATA(NC_UBYTE, length);
+        ALLOCATE_MEMORY_REC_DATA(NC_USHORT, length);
+        ALLOCATE_MEMORY_REC_DATA(NC_UINT, length);
+        ALLOCATE_MEMORY_REC_DATA(NC_INT64, length);
+        ALLOCATE_MEMORY_REC_DATA(NC_UINT64, length);
+        ALLOCATE_MEMORY_REC_DATA(NC_STRING, length);
+    default:
+        return false;
     }
 
+    if (!var->created_data)
+        return false;
+
+    // Inicializar com NaN (antes das threads)
+    if (var->type == NC_FLOAT)
+        for (unsigned int i = 0; i < length; i++)
+            ((float *)var->created_data)[i] = NAN;
+    else if (var->type == NC_DOUBLE)
+        for (unsigned int i = 0; i < length; i++)
+            ((double *)var->created_data)[i] = NAN;
+    else
+        memset(var->created_data, 0, length * data_type_size(var->type));
+
+    return true;
+}
+
+/**
+ * @brief Cálculo da métrica de distância Monache
+ *
+ * Implementa distância euclidiana entre duas janelas de dados
+ * com suporte a múltiplos tipos de dados (kernels de distance.h).
+ */
+double monache_metric(Variable *var, DataSegment *ds, int forecast, int analog, int i)
+{
+    double sum = window_sqdist(var, forecast - ds->k, analog - ds->k, ds->win_size);
+
     return isnan(sum) ? NAN : sqrt(sum);
 }
 
@@ -132,29 +343,14 @@ double monache_metric(Variable *var, DataSegment *ds, int forecast, int analog,
  * @brief Cálculo da métrica Monache para múltiplas séries
  *
  * Versão estendida que considera múltiplas séries temporais,
- * somando as distâncias de todas as séries.
+ * somando as distâncias de todas as séries. file aponta para o
+ * primeiro preditor (&file[1]): são somadas as ds->argc - 1 séries
+ * preditoras, como em monache_metric_super_window_kdtree.
  */
 double monache_metric_super_window(NetCDF *file, DataSegment *ds, int forecast, int analog, int i)
 {
-    double sum = 0.0;
-
-    for (int f = 0; f < (ds->argc); f++)
-    { // Soma sobre séries temporais
-        switch (file[f].var[i].type)
-        {
-            MONACHESW(NC_BYTE);
-            MONACHESW(NC_CHAR);
-            MONACHESW(NC_SHORT);
-            MONACHESW(NC_INT);
-            MONACHESW(NC_FLOAT);
-            MONACHESW(NC_DOUBLE);
-            MONACHESW(NC_UBYTE);
-            MONACHESW(NC_USHORT);
-            MONACHESW(NC_UINT);
-            MONACHESW(NC_INT64);
-            MONACHESW(NC_UINT64);
-        }
-    }
+    // Soma sobre as séries preditoras
+    double sum = series_sqdist(file, 0, ds->argc - 1, i, forecast - ds->k, analog - ds->k, ds->win_size);
 
     return isnan(sum) ? NAN : sqrt(sum);
 }
@@ -315,12 +511,12 @@ void recreate_data(NetCDF *file, DataSegment *ds, ClosestPoint *closest,
 }
 
 /**
- * @brief Calcula RMSE com mapeamento correto de índices
+ * @brief Acumula os termos do RMSE de [start_prediction, end_prediction]
  *
- * Versão corrigida que compara corretamente dados originais
- * com dados reconstruídos, respeitando o mapeamento de índices.
+ * Permite calcular o RMSE bloco a bloco (ds->prediction_chunk), com
+ * created_data cobrindo apenas o bloco.
  */
-void calculate_rmse(NetCDF *file, DataSegment *ds, int n)
+void accumulate_rmse(NetCDF *file, DataSegment *ds, int n, double *sum, int *total)
 {
     double sum_error = 0;
     int count = 0;
@@ -371,6 +567,23 @@ void calculate_rmse(NetCDF *file, DataSegment *ds, int n)
         created_index++; // Incrementar índice dos dados reconstruídos
     }
 
+    *sum += sum_error;
+    *total += count;
+}
+
+/**
+ * @brief Calcula RMSE com mapeamento correto de índices
+ *
+ * Versão corrigida que compara corretamente dados originais
+ * com dados reconstruídos, respeitando o mapeamento de índices.
+ */
+void calculate_rmse(NetCDF *file, DataSegment *ds, int n)
+{
+    double sum_error = 0;
+    int count = 0;
+
+    accumulate_rmse(file, ds, n, &sum_error, &count);
+
     if (count > 0)
     {
         file->var[n].rmse = sqrt(sum_error / count);
@@ -504,17 +717,87 @@ void free_prefiltered_data(PreFilteredData *filtered)
     filtered->num_valid_analogs = 0;
 }
 
+/**
+ * @brief Séries preditoras (file[1..argc-1]) da variável n em double
+ *
+ * O motor diagonal lê as séries pelo índice de tempo, sem despacho de
+ * tipo no laço interno; NaN é preservado.
+ */
+static double **diagonal_series(NetCDF *file, DataSegment *ds, int n)
+{
+    double **series = (double **)malloc((ds->argc - 1) * sizeof(double *));
+
+    if (!series)
+    {
+        fprintf(stderr, "Erro: Falha na alocação das séries do motor diagonal\n");
+        exit(1);
+    }
+
+    for (int s = 0; s < ds->argc - 1; s++)
+    {
+        Variable *var = &file[s + 1].var[n];
+        size_t len = file[s + 1].dim->len;
+        double *column = (double *)malloc(len * sizeof(double));
+
+        if (!column)
+        {
+            fprintf(stderr, "Erro: Falha na alocação das séries do motor diagonal\n");
+            exit(1);
+        }
+
+        switch (var->type)
+        {
+            SERIES_AS_DOUBLE(NC_BYTE);
+            SERIES_AS_DOUBLE(NC_CHAR);
+            SERIES_AS_DOUBLE(NC_SHORT);
+            SERIES_AS_DOUBLE(NC_INT);
+            SERIES_AS_DOUBLE(NC_FLOAT);
+            SERIES_AS_DOUBLE(NC_DOUBLE);
+            SERIES_AS_DOUBLE(NC_UBYTE);
+            SERIES_AS_DOUBLE(NC_USHORT);
+            SERIES_AS_DOUBLE(NC_UINT);
+            SERIES_AS_DOUBLE(NC_INT64);
+            SERIES_AS_DOUBLE(NC_UINT64);
+        default:
+            for (size_t j = 0; j < len; j++)
+                column[j] = NAN;
+            break;
+        }
+
+        series[s] = column;
+    }
+
+    return series;
+}
+
 /**
  * @brief Worker thread para processamento ANEN
  *
  * Função executada por cada thread no algoritmo ANEN paralelo.
  * Processa uma faixa de forecasts usando dados pré-filtrados,
  * garantindo que não há validações durante o processamento.
+ *
+ * Forecasts e analogs consecutivos compartilham win_size - 1 amostras:
+ * ao longo de cada diagonal (analog = forecast + d) a soma dos quadrados
+ * é atualizada somando o par de amostras que entra na janela e
+ * subtraindo o que sai, em O(séries) por par. Amostras NaN são contadas
+ * à parte (a distância só vale com contagem zero) e a soma é recalculada
+ * a cada bloco de ANEN_DIAGONAL_BLOCK forecasts, o que limita o erro de
+ * arredondamento acumulado. Para cada forecast, os analogs são visitados
+ * em ordem crescente, como na busca par a par; os candidatos guardam a
+ * distância ao quadrado, que preserva a ordem e dispensa a raiz por par.
  */
 void *anen_parallel_worker(void *arg)
 {
     ANENWorkerData *worker = (ANENWorkerData *)arg;
     ANENSharedData *shared = worker->shared;
+    DataSegment *ds = shared->ds;
+    PreFilteredData *filtered = shared->filtered_data;
+    const unsigned char *valid = shared->valid;
+    double **series = shared->series;
+    int num_series = shared->num_series;
+    int num_Na = ds->num_Na;
+    int k = ds->k;
 
     // Inicializar contadores locais
     worker->processed_count = 0;
@@ -522,68 +805,519 @@ void *anen_parallel_worker(void *arg)
     struct timeval worker_start, worker_end, rec_start, rec_end;
     gettimeofday(&worker_start, 0);
 
-    // Processar forecasts atribuídos a esta thread
-    for (int f_idx = worker->start_forecast_idx; f_idx < worker->end_forecast_idx; f_idx++)
+    if (worker->start_forecast_idx >= worker->end_forecast_idx)
     {
-        int forecast = shared->filtered_data->valid_forecasts[f_idx];
+        worker->processing_time = 0.0;
+        return NULL;
+    }
 
-        // Alocar estrutura de candidatos (cada thread tem a sua)
-        ClosestPoint *closest = allocate_closest_points_safe(shared->ds->num_Na);
-        if (!closest)
+    // Faixa de tempo desta thread e analogs cuja janela cabe nos dados
+    int first = filtered->valid_forecasts[worker->start_forecast_idx];
+    int last = filtered->valid_forecasts[worker->end_forecast_idx - 1];
+    int data_length = shared->predictor_file->dim->len;
+    int analog_lo = ds->start_training > k ? ds->start_training : k;
+    int analog_hi = ds->end_training < data_length - 1 - k ? ds->end_training : data_length - 1 - k;
+
+    // Candidatos de cada forecast do bloco (cada thread tem os seus)
+    ClosestPoint *closest = allocate_closest_points_safe(ANEN_DIAGONAL_BLOCK * num_Na);
+    int *found = (int *)malloc(ANEN_DIAGONAL_BLOCK * sizeof(int));
+    double *bound = (double *)malloc(ANEN_DIAGONAL_BLOCK * sizeof(double));
+    if (!closest || !found || !bound)
+    {
+        fprintf(stderr, "[Thread %d] Erro na alocação de ClosestPoint\n", worker->thread_id);
+        free(closest);
+        free(found);
+        free(bound);
+        return NULL;
+    }
+
+    for (int block = first; block <= last; block += ANEN_DIAGONAL_BLOCK)
+    {
+        int block_end = block + ANEN_DIAGONAL_BLOCK - 1 < last ? block + ANEN_DIAGONAL_BLOCK - 1 : last;
+
+        memset(found, 0, ANEN_DIAGONAL_BLOCK * sizeof(int));
+        for (int t = 0; t < ANEN_DIAGONAL_BLOCK; t++)
+            bound[t] = INFINITY;
+
+        // Diagonais em ordem crescente de d: cada forecast vê os analogs em ordem
+        for (int d = analog_lo - block_end; d <= analog_hi - block; d++)
         {
-            fprintf(stderr, "[Thread %d] Erro na alocação de ClosestPoint\n", worker->thread_id);
-            continue;
+            int t_lo = block > analog_lo - d ? block : analog_lo - d;
+            int t_hi = block_end < analog_hi - d ? block_end : analog_hi - d;
+            double sum = 0.0;
+            int nan_count = 0;
+
+            if (t_lo > t_hi)
+                continue;
+
+            // Soma completa da primeira janela da diagonal
+            for (int s = 0; s < num_series; s++)
+                for (int j = t_lo - k; j <= t_lo + k; j++)
+                {
+                    double diff = series[s][j] - series[s][j + d];
+                    if (isnan(diff))
+                        nan_count++;
+                    else
+                        sum += diff * diff;
+                }
+
+            for (int t = t_lo;; t++)
+            {
+                // bound: pior candidato do forecast (INFINITY até completar num_Na)
+                if (sum < bound[t - block] && nan_count == 0 && valid[t] && valid[t + d])
+                {
+                    ClosestPoint *candidates = &closest[(t - block) * num_Na];
+
+                    if (topk_push(candidates, &found[t - block], num_Na, t + d, sum > 0.0 ? sum : 0.0))
+                        bound[t - block] = topk_threshold(candidates, found[t - block], num_Na);
+                }
+
+                if (t == t_hi)
+                    break;
+
+                // Desliza a janela: sai a amostra t - k, entra t + k + 1
+                for (int s = 0; s < num_series; s++)
+                {
+                    double out = series[s][t - k] - series[s][t - k + d];
+                    double in = series[s][t + k + 1] - series[s][t + k + 1 + d];
+
+                    if (isnan(out))
+                        nan_count--;
+                    else
+                        sum -= out * out;
+
+                    if (isnan(in))
+                        nan_count++;
+                    else
+                        sum += in * in;
+                }
+            }
+        }
+
+        // Reconstruir dados (thread-safe: cada thread escreve em posições diferentes)
+        gettimeofday(&rec_start, 0);
+        for (int t = block; t <= block_end; t++)
+        {
+            if (!valid[t])
+                continue;
+
+            recreate_data(shared->predicted_file, ds, &closest[(t - block) * num_Na],
+                          t - ds->start_prediction, shared->n, found[t - block]);
+            worker->processed_count++;
+        }
+        gettimeofday(&rec_end, 0);
+
+        worker->reconstruct_time += (rec_end.tv_sec - rec_start.tv_sec) +
+                              (rec_end.tv_usec - rec_start.tv_usec) * 1e-6;
+    }
+
+    free(closest);
+    free(found);
+    free(bound);
+
+    gettimeofday(&worker_end, 0);
+    worker->processing_time = (worker_end.tv_sec - worker_start.tv_sec) +
+                              (worker_end.tv_usec - worker_start.tv_usec) * 1e-6;
+
+    return NULL;
+}
+
+/**
+ * @brief Super janelas (séries x win_size) das posições dadas, em linhas
+ *
+ * Preenche windows (count x dim) e norms (||linha||²); NaN em qualquer
+ * amostra se propaga para a norma e para as distâncias da linha.
+ */
+static void gemm_windows(ANENSharedData *shared, const int *positions, int count,
+                         double *windows, double *norms)
+{
+    int k = shared->ds->k;
+    int win_size = shared->ds->win_size;
+
+    for (int r = 0; r < count; r++)
+    {
+        double *row = &windows[(size_t)r * shared->dim];
+        double norm = 0.0;
+
+        for (int s = 0; s < shared->num_series; s++)
+            for (int j = 0; j < win_size; j++)
+            {
+                double value = shared->series[s][positions[r] - k + j];
+                row[s * win_size + j] = value;
+                norm += value * value;
+            }
+
+        norms[r] = norm;
+    }
+}
+
+/**
+ * @brief Worker thread para processamento ANEN por blocos GEMM
+ *
+ * Cada tile de ANEN_GEMM_FORECASTS forecasts x ANEN_GEMM_ANALOGS analogs
+ * é -2a·b (gsl_blas_dgemm); somando as normas tem-se a distância ao
+ * quadrado, que alimenta o top-k de cada forecast ainda dentro do tile.
+ * Os analogs são visitados em ordem crescente, como na busca par a par.
+ * Os vizinhos do primeiro forecast de cada tile são recalculados pela
+ * métrica direta (series_sqdist) para medir o erro de cancelamento.
+ */
+void *anen_gemm_worker(void *arg)
+{
+    ANENWorkerData *worker = (ANENWorkerData *)arg;
+    ANENSharedData *shared = worker->shared;
+    DataSegment *ds = shared->ds;
+    PreFilteredData *filtered = shared->filtered_data;
+    int num_Na = ds->num_Na;
+
+    // Inicializar contadores locais
+    worker->processed_count = 0;
+    worker->max_error = 0.0;
+
+    struct timeval worker_start, worker_end, rec_start, rec_end;
+    gettimeofday(&worker_start, 0);
+
+    // Tile de resultado e candidatos de cada forecast (cada thread tem os seus)
+    double *tile = (double *)malloc(ANEN_GEMM_FORECASTS * ANEN_GEMM_ANALOGS * sizeof(double));
+    ClosestPoint *closest = allocate_closest_points_safe(ANEN_GEMM_FORECASTS * num_Na);
+    int *found = (int *)malloc(ANEN_GEMM_FORECASTS * sizeof(int));
+    if (!tile || !closest || !found)
+    {
+        fprintf(stderr, "[Thread %d] Erro na alocação do tile GEMM\n", worker->thread_id);
+        free(tile);
+        free(closest);
+        free(found);
+        return NULL;
+    }
+
+    for (int f0 = worker->start_forecast_idx; f0 < worker->end_forecast_idx; f0 += ANEN_GEMM_FORECASTS)
+    {
+        int rows = worker->end_forecast_idx - f0 < ANEN_GEMM_FORECASTS ? worker->end_forecast_idx - f0
+                                                                      : ANEN_GEMM_FORECASTS;
+        gsl_matrix_const_view forecasts =
+            gsl_matrix_const_view_array(&shared->forecast_windows[(size_t)f0 * shared->dim], rows, shared->dim);
+
+        memset(found, 0, rows * sizeof(int));
+
+        for (int a0 = 0; a0 < filtered->num_valid_analogs; a0 += ANEN_GEMM_ANALOGS)
+        {
+            int cols = filtered->num_valid_analogs - a0 < ANEN_GEMM_ANALOGS ? filtered->num_valid_analogs - a0
+                                                                           : ANEN_GEMM_ANALOGS;
+            gsl_matrix_const_view analogs =
+                gsl_matrix_const_view_array(&shared->analog_windows[(size_t)a0 * shared->dim], cols, shared->dim);
+            gsl_matrix_view result = gsl_matrix_view_array(tile, rows, cols);
+
+            gsl_blas_dgemm(CblasNoTrans, CblasTrans, -2.0, &forecasts.matrix, &analogs.matrix, 0.0, &result.matrix);
+
+            // Top-k fundido sobre o tile (NaN falha na comparação e é descartado)
+            for (int r = 0; r < rows; r++)
+            {
+                double forecast_norm = shared->forecast_norms[f0 + r];
+                double *line = &tile[r * cols];
+
+                for (int c = 0; c < cols; c++)
+                {
+                    line[c] += forecast_norm + shared->analog_norms[a0 + c];
+                    if (line[c] < 0.0)
+                        line[c] = 0.0;
+                }
+
+                topk_push_batch(&closest[r * num_Na], &found[r], num_Na, &filtered->valid_analogs[a0], line, cols);
+            }
         }
 
+        // Conferência com a métrica direta: vizinhos do primeiro forecast do tile
+        int forecast = filtered->valid_forecasts[f0];
+        for (int c = 0; c < found[0]; c++)
+        {
+            int analog = closest[c].window_index;
+            double direct = series_sqdist(shared->predictor_file, 0, shared->num_series, shared->n,
+                                          forecast - ds->k, analog - ds->k, ds->win_size);
+            int a = 0;
+
+            // Linha do analog (valid_analogs é crescente)
+            for (int lo = 0, hi = filtered->num_valid_analogs - 1; lo <= hi;)
+            {
+                a = (lo + hi) / 2;
+                if (filtered->valid_analogs[a] == analog)
+                    break;
+                if (filtered->valid_analogs[a] < analog)
+                    lo = a + 1;
+                else
+                    hi = a - 1;
+            }
+
+            double scale = shared->forecast_norms[f0] + shared->analog_norms[a];
+            double error = scale > 0.0 ? fabs(closest[c].distance - direct) / scale : 0.0;
+            if (error > worker->max_error)
+                worker->max_error = error;
+        }
+
+        // Reconstruir dados (thread-safe: cada thread escreve em posições diferentes)
+        gettimeofday(&rec_start, 0);
+        for (int r = 0; r < rows; r++)
+        {
+            recreate_data(shared->predicted_file, ds, &closest[r * num_Na],
+                          filtered->valid_forecasts[f0 + r] - ds->start_prediction, shared->n, found[r]);
+            worker->processed_count++;
+        }
+        gettimeofday(&rec_end, 0);
+
+        worker->reconstruct_time += (rec_end.tv_sec - rec_start.tv_sec) +
+                              (rec_end.tv_usec - rec_start.tv_usec) * 1e-6;
+    }
+
+    free(tile);
+    free(closest);
+    free(found);
+
+    gettimeofday(&worker_end, 0);
+    worker->processing_time = (worker_end.tv_sec - worker_start.tv_sec) +
+                              (worker_end.tv_usec - worker_start.tv_usec) * 1e-6;
+
+    return NULL;
+}
+
+/**
+ * @brief Momentos da super janela de cada posição dada, por série
+ *
+ * Para cada série, sum(x)/sqrt(win_size) e a norma da janela centrada,
+ * ||x - média||, em moments (count x 2·séries). A distância entre os
+ * momentos de duas janelas é um limite inferior da distância entre elas:
+ * ||a - b||² = win_size·(média_a - média_b)² + ||ã - b̃||², e pela
+ * desigualdade triangular reversa ||ã - b̃|| >= | ||ã|| - ||b̃|| |.
+ */
+static void window_moments(ANENSharedData *shared, const int *positions, int count, double *moments)
+{
+    int k = shared->ds->k;
+    int win_size = shared->ds->win_size;
+    double scale = sqrt((double)win_size);
+
+    for (int r = 0; r < count; r++)
+    {
+        double *row = &moments[(size_t)r * 2 * shared->num_series];
+
+        for (int s = 0; s < shared->num_series; s++)
+        {
+            const double *x = &shared->series[s][positions[r] - k];
+            double sum = 0.0, centered = 0.0;
+
+            for (int j = 0; j < win_size; j++)
+                sum += x[j];
+            for (int j = 0; j < win_size; j++)
+            {
+                double diff = x[j] - sum / win_size;
+                centered += diff * diff;
+            }
+
+            row[2 * s] = sum / scale;
+            row[2 * s + 1] = sqrt(centered);
+        }
+    }
+}
+
+/**
+ * @brief Envelopes dos blocos de ANEN_ENVELOPE_BLOCK analogs válidos consecutivos
+ *
+ * Para cada bloco, o mínimo e o máximo de cada dimensão da super janela
+ * (séries x win_size) e dos momentos (window_moments), em envelopes
+ * (blocos x 2·(dim + 2·séries): mínimos seguidos dos máximos). Janelas
+ * vizinhas compartilham win_size - 1 amostras, o que mantém o envelope
+ * estreito.
+ */
+static void analog_envelopes(ANENSharedData *shared, double *envelopes)
+{
+    PreFilteredData *filtered = shared->filtered_data;
+    int k = shared->ds->k;
+    int win_size = shared->ds->win_size;
+    int moments = 2 * shared->num_series;
+    int width = shared->dim + moments;
+
+    for (int b = 0; b < shared->num_blocks; b++)
+    {
+        double *lower = &envelopes[(size_t)b * 2 * width];
+        double *upper = lower + width;
+        int a_first = b * ANEN_ENVELOPE_BLOCK;
+        int a_last = a_first + ANEN_ENVELOPE_BLOCK < filtered->num_valid_analogs ? a_first + ANEN_ENVELOPE_BLOCK
+                                                                                 : filtered->num_valid_analogs;
+
+        for (int j = 0; j < width; j++)
+        {
+            lower[j] = INFINITY;
+            upper[j] = -INFINITY;
+        }
+
+        for (int a = a_first; a < a_last; a++)
+        {
+            const double *analog_moments = &shared->analog_moments[(size_t)a * moments];
+
+            for (int s = 0; s < shared->num_series; s++)
+                for (int j = 0; j < win_size; j++)
+                {
+                    double value = shared->series[s][filtered->valid_analogs[a] - k + j];
+                    lower[s * win_size + j] = fmin(lower[s * win_size + j], value);
+                    upper[s * win_size + j] = fmax(upper[s * win_size + j], value);
+                }
+
+            for (int j = 0; j < moments; j++)
+            {
+                lower[shared->dim + j] = fmin(lower[shared->dim + j], analog_moments[j]);
+                upper[shared->dim + j] = fmax(upper[shared->dim + j], analog_moments[j]);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Distância ao quadrado de x à caixa [lower, upper], até passar de limit
+ */
+static inline double envelope_sqdist(const double *x, const double *lower, const double *upper,
+                                     int count, double limit)
+{
+    double sum = 0.0;
+
+    for (int j = 0; j < count && sum <= limit; j++)
+    {
+        double gap = x[j] < lower[j] ? lower[j] - x[j] : x[j] > upper[j] ? x[j] - upper[j] : 0.0;
+        sum += gap * gap;
+    }
+
+    return sum;
+}
+
+/**
+ * @brief Worker thread para processamento ANEN com poda por limite inferior
+ *
+ * Busca par a par, com os analogs em ordem crescente, que mantém o
+ * k-ésimo melhor candidato de cada forecast como limiar. Blocos de
+ * analogs cujo envelope (analog_envelopes) fica além do limiar são
+ * descartados inteiros; nos demais, o analog é descartado sem calcular a
+ * distância quando o limite inferior dos momentos (window_moments) já
+ * passa do limiar, e a soma é interrompida, dentro da janela de cada
+ * série, assim que a parcial o alcança. Só são descartados pares que não entrariam nos num_Na mais
+ * próximos, logo o resultado é o mesmo da busca completa.
+ */
+void *anen_pruned_worker(void *arg)
+{
+    ANENWorkerData *worker = (ANENWorkerData *)arg;
+    ANENSharedData *shared = worker->shared;
+    DataSegment *ds = shared->ds;
+    PreFilteredData *filtered = shared->filtered_data;
+    double **series = shared->series;
+    int num_series = shared->num_series;
+    int num_Na = ds->num_Na;
+    int k = ds->k;
+    int win_size = ds->win_size;
+
+    // Inicializar contadores locais
+    worker->processed_count = 0;
+    worker->pruned_count = 0;
+    worker->abandoned_count = 0;
+    worker->envelope_count = 0;
+
+    int moments = 2 * num_series;
+    int width = shared->dim + moments;
+    double slack = 1.0 + ANEN_PRUNE_SLACK;
+
+    struct timeval worker_start, worker_end, rec_start, rec_end;
+    gettimeofday(&worker_start, 0);
+
+    ClosestPoint *closest = allocate_closest_points_safe(num_Na);
+    if (!closest)
+    {
+        fprintf(stderr, "[Thread %d] Erro na alocação de ClosestPoint\n", worker->thread_id);
+        return NULL;
+    }
+
+    for (int f = worker->start_forecast_idx; f < worker->end_forecast_idx; f++)
+    {
+        int forecast = filtered->valid_forecasts[f];
+        const double *forecast_moments = &shared->forecast_moments[(size_t)f * moments];
+        double bound = INFINITY;
         int found = 0;
 
-        // Loop de analogs SEM validações - todos já são válidos!
-        for (int a_idx = 0; a_idx < shared->filtered_data->num_valid_analogs; a_idx++)
+        for (int b = 0; b < shared->num_blocks; b++)
         {
-            int analog = shared->filtered_data->valid_analogs[a_idx];
+            int a_first = b * ANEN_ENVELOPE_BLOCK;
+            int a_last = a_first + ANEN_ENVELOPE_BLOCK < filtered->num_valid_analogs ? a_first + ANEN_ENVELOPE_BLOCK
+                                                                                     : filtered->num_valid_analogs;
 
-            // Calcular distância diretamente - ZERO overhead de validação
-            double distance = monache_metric_super_window(shared->predictor_file, shared->ds,
-                                                          forecast, analog, shared->n);
+            // Envelope do bloco: primeiro os momentos, depois as janelas
+            if (bound < INFINITY)
+            {
+                const double *lower = &shared->envelopes[(size_t)b * 2 * width];
+                const double *upper = lower + width;
+                double limit = bound * slack;
+                double gap = 0.0;
+                bool outside = envelope_sqdist(forecast_moments, lower + shared->dim, upper + shared->dim,
+                                               moments, limit) > limit;
+
+                for (int s = 0; s < num_series && !outside; s++)
+                {
+                    gap += envelope_sqdist(&series[s][forecast - k], lower + s * win_size,
+                                           upper + s * win_size, win_size, limit - gap);
+                    outside = gap > limit;
+                }
+                if (outside)
+                {
+                    worker->envelope_count += a_last - a_first;
+                    continue;
+                }
+            }
 
-            if (!isnan(distance))
+            for (int a = a_first; a < a_last; a++)
             {
-                // Gerenciar heap de candidatos (dados locais da thread - thread-safe)
-                if (found < shared->ds->num_Na)
+                int analog = filtered->valid_analogs[a];
+                const double *analog_moments = &shared->analog_moments[(size_t)a * moments];
+                double lower = 0.0;
+
+                // Limite inferior: descarta o analog sem ler as janelas
+                for (int j = 0; j < moments; j++)
                 {
-                    closest[found].window_index = analog;
-                    closest[found].distance = distance;
-                    found++;
-                    if (found == shared->ds->num_Na)
-                    {
-                        qsort(closest, shared->ds->num_Na, sizeof(ClosestPoint),
-                              compare_closest_point_ord_const);
-                    }
+                    double diff = forecast_moments[j] - analog_moments[j];
+                    lower += diff * diff;
+                }
+                if (lower > bound * slack)
+                {
+                    worker->pruned_count++;
+                    continue;
                 }
-                else if (distance < closest[0].distance)
+
+                // Distância por série, interrompida dentro da janela assim que
+                // a parcial alcança o limiar (sqdist_double_limit)
+                double sum = 0.0;
+                bool abandoned = false;
+                for (int s = 0; s < num_series && !abandoned; s++)
                 {
-                    closest[0].window_index = analog;
-                    closest[0].distance = distance;
-                    qsort(closest, shared->ds->num_Na, sizeof(ClosestPoint),
-                          compare_closest_point_ord_const);
+                    double limit = bound * slack - sum;
+                    double part = sqdist_double_limit(&series[s][forecast - k], &series[s][analog - k],
+                                                      win_size, limit);
+                    abandoned = part >= limit;
+                    sum += part;
                 }
+                if (abandoned)
+                {
+                    worker->abandoned_count++;
+                    continue;
+                }
+
+                // NaN falha na comparação e é descartado
+                if (sum < bound && topk_push(closest, &found, num_Na, analog, sum))
+                    bound = topk_threshold(closest, found, num_Na);
             }
         }
 
         // Reconstruir dados (thread-safe: cada thread escreve em posições diferentes)
-        int created_data_index = forecast - shared->ds->start_prediction;
         gettimeofday(&rec_start, 0);
-        recreate_data(shared->predicted_file, shared->ds, closest,
-                      created_data_index, shared->n, found);
+        recreate_data(shared->predicted_file, ds, closest, forecast - ds->start_prediction, shared->n, found);
+        worker->processed_count++;
         gettimeofday(&rec_end, 0);
 
         worker->reconstruct_time += (rec_end.tv_sec - rec_start.tv_sec) +
                               (rec_end.tv_usec - rec_start.tv_usec) * 1e-6;
-
-        free(closest);
-        worker->processed_count++;
     }
 
+    free(closest);
+
     gettimeofday(&worker_end, 0);
     worker->processing_time = (worker_end.tv_sec - worker_start.tv_sec) +
                               (worker_end.tv_usec - worker_start.tv_usec) * 1e-6;
@@ -592,63 +1326,29 @@ void *anen_parallel_worker(void *arg)
 }
 
 /**
- * @brief Algoritmo ANEN Paralelo - Analog Ensemble com pré-filtro
+ * @brief Laço comum dos algoritmos ANEN exaustivos
  *
- * Implementa busca exaustiva otimizada com pré-filtro de dados válidos.
- * Elimina validações durante o processamento principal através de
- * pré-computação sequencial dos índices válidos.
+ * Pré-filtro, alocação e divisão dos forecasts entre as threads de
+ * worker_func (anen_parallel_worker, anen_gemm_worker ou
+ * anen_pruned_worker).
  */
-void anen_dependent_parallel(NetCDF *file, DataSegment *ds)
+static void anen_dependent_run(NetCDF *file, DataSegment *ds, void *(*worker_func)(void *))
 {
     NetCDF *predicted_file = &file[0];
     NetCDF *predictor_file = &file[1];
 
     for (int n = 1; n - 1 < predicted_file->nvars - 13; n++)
     {
+        acquire_processing_variable(file, ds, n);
+
         if (predicted_file->var[n].invalid_percentage <= (double)15 &&
             predicted_file->var[n].invalid_percentage != (double)0)
         {
             unsigned int length = (ds->end_prediction - ds->start_prediction) + 1;
 
             // ========== ALOCAÇÃO DE MEMÓRIA ==========
-            switch (predictor_file->var[n].type)
-            {
-                ALLOCATE_MEMORY_REC_DATA(NC_BYTE, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_CHAR, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_SHORT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_INT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_FLOAT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_DOUBLE, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_UBYTE, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_USHORT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_UINT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_INT64, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_UINT64, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_STRING, length);
-            default:
-                predicted_file->var[n].created_data = malloc(length * sizeof(float));
-                break;
-            }
-
-            if (!predicted_file->var[n].created_data)
-                continue;
-
-            // Inicializar com NaN (thread-safe: feito antes das threads)
-            for (int i = 0; i < length; i++)
-            {
-                switch (predictor_file->var[n].type)
-                {
-                case NC_FLOAT:
-                    ((float *)predicted_file->var[n].created_data)[i] = NAN;
-                    break;
-                case NC_DOUBLE:
-                    ((double *)predicted_file->var[n].created_data)[i] = NAN;
-                    break;
-                default:
-                    ((float *)predicted_file->var[n].created_data)[i] = NAN;
-                    break;
-                }
-            }
+            if (!allocate_created_data(predicted_file, n, length))
+                goto discard;
 
             // ========== FASE 1: PRÉ-FILTRAR DADOS (SEQUENCIAL) ==========
             struct timeval begin_prefilter, end_prefilter;
@@ -662,13 +1362,25 @@ void anen_dependent_parallel(NetCDF *file, DataSegment *ds)
             if (filtered_data.num_valid_forecasts == 0)
             {
                 free_prefiltered_data(&filtered_data);
-                continue;
+                goto discard;
             }
 
             // ========== FASE 2: PROCESSAMENTO PARALELO ==========
             struct timeval begin_parallel, end_parallel;
             gettimeofday(&begin_parallel, 0);
 
+            // Máscara de forecasts/analogs válidos e séries do motor diagonal
+            unsigned char *valid = (unsigned char *)calloc(predictor_file->dim->len, 1);
+            if (!valid)
+            {
+                fprintf(stderr, "Erro: Falha na alocação da máscara de validade\n");
+                exit(1);
+            }
+            for (int i = 0; i < filtered_data.num_valid_forecasts; i++)
+                valid[filtered_data.valid_forecasts[i]] = 1;
+            for (int i = 0; i < filtered_data.num_valid_analogs; i++)
+                valid[filtered_data.valid_analogs[i]] = 1;
+
             // Configurar dados compartilhados
             ANENSharedData shared_data;
             shared_data.predicted_file = predicted_file;
@@ -676,6 +1388,70 @@ void anen_dependent_parallel(NetCDF *file, DataSegment *ds)
             shared_data.ds = ds;
             shared_data.n = n;
             shared_data.filtered_data = &filtered_data;
+            shared_data.series = diagonal_series(file, ds, n);
+            shared_data.num_series = ds->argc - 1;
+            shared_data.valid = valid;
+            shared_data.dim = shared_data.num_series * ds->win_size;
+            shared_data.forecast_windows = NULL;
+            shared_data.analog_windows = NULL;
+            shared_data.forecast_norms = NULL;
+            shared_data.analog_norms = NULL;
+            shared_data.forecast_moments = NULL;
+            shared_data.analog_moments = NULL;
+            shared_data.num_blocks = 0;
+            shared_data.envelopes = NULL;
+
+            // Matrizes de super janelas e normas (motor GEMM)
+            if (worker_func == anen_gemm_worker)
+            {
+                int num_forecasts = filtered_data.num_valid_forecasts;
+                int num_analogs = filtered_data.num_valid_analogs;
+
+                shared_data.forecast_windows = (double *)malloc((size_t)num_forecasts * shared_data.dim * sizeof(double));
+                shared_data.analog_windows = (double *)malloc((size_t)num_analogs * shared_data.dim * sizeof(double));
+                shared_data.forecast_norms = (double *)malloc(num_forecasts * sizeof(double));
+                shared_data.analog_norms = (double *)malloc(num_analogs * sizeof(double));
+                if (!shared_data.forecast_windows || !shared_data.analog_windows ||
+                    !shared_data.forecast_norms || !shared_data.analog_norms)
+                {
+                    fprintf(stderr, "Erro: Falha na alocação das matrizes do motor GEMM\n");
+                    exit(1);
+                }
+
+                gemm_windows(&shared_data, filtered_data.valid_forecasts, num_forecasts,
+                             shared_data.forecast_windows, shared_data.forecast_norms);
+                gemm_windows(&shared_data, filtered_data.valid_analogs, num_analogs,
+                             shared_data.analog_windows, shared_data.analog_norms);
+            }
+
+            // Momentos das janelas (limite inferior do motor com poda)
+            if (worker_func == anen_pruned_worker)
+            {
+                int num_forecasts = filtered_data.num_valid_forecasts;
+                int num_analogs = filtered_data.num_valid_analogs;
+
+                shared_data.forecast_moments = (double *)malloc((size_t)num_forecasts * 2 * shared_data.num_series * sizeof(double));
+                shared_data.analog_moments = (double *)malloc((size_t)num_analogs * 2 * shared_data.num_series * sizeof(double));
+                if (!shared_data.forecast_moments || !shared_data.analog_moments)
+                {
+                    fprintf(stderr, "Erro: Falha na alocação dos momentos do motor com poda\n");
+                    exit(1);
+                }
+
+                window_moments(&shared_data, filtered_data.valid_forecasts, num_forecasts, shared_data.forecast_moments);
+                window_moments(&shared_data, filtered_data.valid_analogs, num_analogs, shared_data.analog_moments);
+
+                // Envelopes dos blocos de analogs consecutivos
+                shared_data.num_blocks = (num_analogs + ANEN_ENVELOPE_BLOCK - 1) / ANEN_ENVELOPE_BLOCK;
+                shared_data.envelopes = (double *)malloc((size_t)shared_data.num_blocks * 2 *
+                                                         (shared_data.dim + 2 * shared_data.num_series) * sizeof(double));
+                if (!shared_data.envelopes)
+                {
+                    fprintf(stderr, "Erro: Falha na alocação dos envelopes do motor com poda\n");
+                    exit(1);
+                }
+                analog_envelopes(&shared_data, shared_data.envelopes);
+            }
 
             // Configurar threads
             pthread_t threads[ds->num_thread];
@@ -695,6 +1471,10 @@ void anen_dependent_parallel(NetCDF *file, DataSegment *ds)
                 workers[t].processed_count = 0;
                 workers[t].reconstruct_time = 0.0;
                 workers[t].processing_time = 0.0;
+                workers[t].max_error = 0.0;
+                workers[t].pruned_count = 0;
+                workers[t].abandoned_count = 0;
+                workers[t].envelope_count = 0;
 
                 // Última thread pega os forecasts restantes
                 if (t == ds->num_thread - 1)
@@ -702,7 +1482,7 @@ void anen_dependent_parallel(NetCDF *file, DataSegment *ds)
                     workers[t].end_forecast_idx += remaining_forecasts;
                 }
 
-                if (pthread_create(&threads[t], NULL, anen_parallel_worker, &workers[t]) != 0)
+                if (pthread_create(&threads[t], NULL, worker_func, &workers[t]) != 0)
                 {
                     fprintf(stderr, "Erro ao criar thread %d\n", t);
                     exit(1);
@@ -721,7 +1501,43 @@ void anen_dependent_parallel(NetCDF *file, DataSegment *ds)
 
             printf("-%.3f,", parallel_time);
 
+            // Conferência do motor GEMM contra a métrica direta
+            double max_error = 0.0;
+            for (int t = 0; t < ds->num_thread; t++)
+                if (workers[t].max_error > max_error)
+                    max_error = workers[t].max_error;
+            if (max_error > ANEN_GEMM_TOLERANCE)
+                fprintf(stderr, "Aviso: erro relativo do GEMM %.3e acima de %.0e na variável %d\n",
+                        max_error, ANEN_GEMM_TOLERANCE, n);
+
+            // Avaliações completas evitadas pelo motor com poda
+            if (worker_func == anen_pruned_worker)
+            {
+                long long envelope = 0, pruned = 0, abandoned = 0;
+                for (int t = 0; t < ds->num_thread; t++)
+                {
+                    envelope += workers[t].envelope_count;
+                    pruned += workers[t].pruned_count;
+                    abandoned += workers[t].abandoned_count;
+                }
+                long long pairs = (long long)filtered_data.num_valid_forecasts * filtered_data.num_valid_analogs;
+                fprintf(stderr, "Variável %d: %lld pares, %lld descartados pelo envelope dos blocos, "
+                                "%lld pelo limite inferior, %lld interrompidos\n",
+                        n, pairs, envelope, pruned, abandoned);
+            }
+
             // ========== LIMPEZA ==========
+            free(shared_data.forecast_windows);
+            free(shared_data.forecast_moments);
+            free(shared_data.analog_moments);
+            free(shared_data.envelopes);
+            free(shared_data.analog_windows);
+            free(shared_data.forecast_norms);
+            free(shared_data.analog_norms);
+            for (int s = 0; s < shared_data.num_series; s++)
+                free(shared_data.series[s]);
+            free(shared_data.series);
+            free(valid);
             free_prefiltered_data(&filtered_data);
         }
 
@@ -736,9 +1552,50 @@ void anen_dependent_parallel(NetCDF *file, DataSegment *ds)
             predicted_file->var[n].rmse = NAN;
             printf("NaN,");
         }
+
+        release_processing_variable(file, ds, n);
+        continue;
+
+    discard:
+        // Saída antecipada: libera a variável sem a série incompleta
+        discard_processing_variable(file, ds, n);
     }
 }
 
+/**
+ * @brief Algoritmo ANEN Paralelo - Analog Ensemble com pré-filtro
+ *
+ * Implementa busca exaustiva otimizada com pré-filtro de dados válidos.
+ * Elimina validações durante o processamento principal através de
+ * pré-computação sequencial dos índices válidos.
+ */
+void anen_dependent_parallel(NetCDF *file, DataSegment *ds)
+{
+    anen_dependent_run(file, ds, anen_parallel_worker);
+}
+
+/**
+ * @brief Algoritmo ANEN Paralelo por blocos GEMM
+ *
+ * Mesma busca exaustiva de anen_dependent_parallel, com as distâncias
+ * de cada tile calculadas por gsl_blas_dgemm.
+ */
+void anen_dependent_parallel_gemm(NetCDF *file, DataSegment *ds)
+{
+    anen_dependent_run(file, ds, anen_gemm_worker);
+}
+
+/**
+ * @brief Algoritmo ANEN Paralelo com poda por limite inferior
+ *
+ * Mesma busca exaustiva de anen_dependent_parallel, par a par, evitando
+ * as distâncias que não podem entrar nos num_Na mais próximos.
+ */
+void anen_dependent_parallel_pruned(NetCDF *file, DataSegment *ds)
+{
+    anen_dependent_run(file, ds, anen_pruned_worker);
+}
+
 // =============================================================================
 // IMPLEMENTACAO DO ALGORITMO KD-ANEN (KD-TREE + ANALOG ENSEMBLE)
 // =============================================================================
@@ -826,6 +1683,8 @@ void kdanen_independent_parallel(NetCDF *file, DataSegment *ds)
 
     for (int n = 1; n - 1 < predicted_file->nvars - 13; n++)
     {
+        acquire_processing_variable(file, ds, n);
+
         if (predicted_file->var[n].invalid_percentage <= (double)15 &&
             predicted_file->var[n].invalid_percentage != (double)0)
         {
@@ -835,44 +1694,8 @@ void kdanen_independent_parallel(NetCDF *file, DataSegment *ds)
             reset_node_pool(global_pool);
 
             // ========== ALOCAÇÃO DE MEMÓRIA ==========
-            switch (predictor_file->var[n].type)
-            {
-                ALLOCATE_MEMORY_REC_DATA(NC_BYTE, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_CHAR, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_SHORT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_INT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_FLOAT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_DOUBLE, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_UBYTE, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_USHORT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_UINT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_INT64, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_UINT64, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_STRING, length);
-            default:
-                predicted_file->var[n].created_data = malloc(length * sizeof(float));
-                break;
-            }
-
-            if (!predicted_file->var[n].created_data)
-                continue;
-
-            // Inicializar com NaN
-            for (int i = 0; i < length; i++)
-            {
-                switch (predictor_file->var[n].type)
-                {
-                case NC_FLOAT:
-                    ((float *)predicted_file->var[n].created_data)[i] = NAN;
-                    break;
-                case NC_DOUBLE:
-                    ((double *)predicted_file->var[n].created_data)[i] = NAN;
-                    break;
-                default:
-                    ((float *)predicted_file->var[n].created_data)[i] = NAN;
-                    break;
-                }
-            }
+            if (!allocate_created_data(predicted_file, n, length))
+                goto discard;
 
             // ========== FASE 1: CONSTRUIR KD-TREE (SEQUENCIAL) ==========
             struct timeval begin_tree, end_tree;
@@ -885,22 +1708,18 @@ void kdanen_independent_parallel(NetCDF *file, DataSegment *ds)
 
             if (!training_indices)
             {
-                continue;
+                goto discard;
             }
 
-            for (int analog = ds->start_training; analog <= ds->end_training; analog++)
-            {
-                if (validate_window_simple(&predictor_file->var[n], analog, ds->k,
-                                           ds->win_size, predictor_file->dim->len))
-                {
-                    training_indices[valid_training_points++] = analog;
-                }
-            }
+            valid_training_points = collect_valid_windows(file, 1, 2, n, ds->start_training,
+                                                          ds->end_training, training_indices);
 
             // Construir KD-Tree balanceada
             KDTree *root = NULL;
             if (valid_training_points > 0)
             {
+                // Um nó por janela válida, num bloco só
+                node_arena_reserve(global_pool, valid_training_points);
                 root = build_balanced_kdtree(training_indices, valid_training_points,
                                              &predictor_file->var[n], ds, 0, global_pool);
             }
@@ -909,7 +1728,7 @@ void kdanen_independent_parallel(NetCDF *file, DataSegment *ds)
 
             if (!root)
             {
-                continue;
+                goto discard;
             }
 
             gettimeofday(&end_tree, 0);
@@ -923,22 +1742,16 @@ void kdanen_independent_parallel(NetCDF *file, DataSegment *ds)
 
             if (!valid_forecasts)
             {
-                continue;
+                goto discard;
             }
 
-            for (int forecast = ds->start_prediction; forecast <= ds->end_prediction; forecast++)
-            {
-                if (validate_window_simple(&predictor_file->var[n], forecast, ds->k,
-                                           ds->win_size, predictor_file->dim->len))
-                {
-                    valid_forecasts[num_valid_forecasts++] = forecast;
-                }
-            }
+            num_valid_forecasts = collect_valid_windows(file, 1, 2, n, ds->start_prediction,
+                                                        ds->end_prediction, valid_forecasts);
 
             if (num_valid_forecasts == 0)
             {
                 free(valid_forecasts);
-                continue;
+                goto discard;
             }
 
             // ========== FASE 3: PROCESSAMENTO PARALELO ==========
@@ -991,7 +1804,6 @@ void kdanen_independent_parallel(NetCDF *file, DataSegment *ds)
             for (int t = 0; t < ds->num_thread; t++)
             {
                 pthread_join(threads[t], NULL);
-                printf("-%.3f,", workers[t].);
             }
 
             gettimeofday(&end_parallel, 0);
@@ -1015,6 +1827,13 @@ void kdanen_independent_parallel(NetCDF *file, DataSegment *ds)
             predicted_file->var[n].rmse = NAN;
             printf("NaN,");
         }
+
+        release_processing_variable(file, ds, n);
+        continue;
+
+    discard:
+        // Saída antecipada: libera a variável sem a série incompleta
+        discard_processing_variable(file, ds, n);
     }
 
     // Free the global node pool at the end
@@ -1038,30 +1857,19 @@ void exhaustive_processing_independent(NetCDF *file, DataSegment *ds)
 
     for (int n = 1; n - 1 < predicted_file->nvars - 13; n++)
     {
+        acquire_processing_variable(file, ds, n);
+
         if (predicted_file->var[n].invalid_percentage <= (double)15 &&
             predicted_file->var[n].invalid_percentage != (double)0)
         {
             int f_valid_count = 0;
             int f_count = 0;
             int a_count = 0;
-            unsigned int length = (ds->end_prediction - ds->start_prediction);
+            unsigned int length = (ds->end_prediction - ds->start_prediction) + 1;
             bool f_is_valid_window = true, f_is_valid_last_win = true;
 
-            switch (predictor_file->var[n].type)
-            {
-                ALLOCATE_MEMORY_REC_DATA(NC_BYTE, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_CHAR, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_SHORT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_INT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_FLOAT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_DOUBLE, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_UBYTE, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_USHORT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_UINT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_INT64, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_UINT64, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_STRING, length);
-            }
+            // Sem created_data, recreate_data não grava e a RMSE fica NaN
+            allocate_created_data(predicted_file, n, length);
 
             f_is_valid_last_win = false;
 
@@ -1091,20 +1899,7 @@ void exhaustive_processing_independent(NetCDF *file, DataSegment *ds)
 
                     if (!isnan(distance))
                     {
-                        if (found < ds->num_Na)
-                        {
-                            closest[found].window_index = analog;
-                            closest[found].distance = distance;
-                            found++;
-                            if (found == ds->num_Na)
-                                qsort(closest, ds->num_Na, sizeof(ClosestPoint), compare_closest_point_ord_const);
-                        }
-                        else if (distance < closest[0].distance)
-                        {
-                            closest[0].window_index = analog;
-                            closest[0].distance = distance;
-                            qsort(closest, ds->num_Na, sizeof(ClosestPoint), compare_closest_point_ord_const);
-                        }
+                        topk_push(closest, &found, ds->num_Na, analog, distance);
                     }
                     a_count++;
                 }
@@ -1124,6 +1919,8 @@ void exhaustive_processing_independent(NetCDF *file, DataSegment *ds)
             predicted_file->var[n].rmse = NAN;
         }
         printf("RMSE: %.3lf\n", predicted_file->var[n].rmse);
+
+        release_processing_variable(file, ds, n);
     }
 }
 
@@ -1140,44 +1937,16 @@ void exhaustive_processing_dependent(NetCDF *file, DataSegment *ds)
 
     for (int n = 1; n - 1 < predicted_file->nvars - 13; n++)
     {
+        acquire_processing_variable(file, ds, n);
+
         if (predicted_file->var[n].invalid_percentage <= (double)15 &&
             predicted_file->var[n].invalid_percentage != (double)0)
         {
             int f_count = 0;
             unsigned int length = (ds->end_prediction - ds->start_prediction) + 1;
 
-            switch (predictor_file->var[n].type)
-            {
-                ALLOCATE_MEMORY_REC_DATA(NC_BYTE, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_CHAR, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_SHORT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_INT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_FLOAT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_DOUBLE, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_UBYTE, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_USHORT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_UINT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_INT64, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_UINT64, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_STRING, length);
-            }
-
-            if (!predicted_file->var[n].created_data)
-                continue;
-
-            // Inicializar com NaN
-            for (int i = 0; i < length; i++)
-            {
-                switch (predictor_file->var[n].type)
-                {
-                case NC_FLOAT:
-                    ((float *)predicted_file->var[n].created_data)[i] = NAN;
-                    break;
-                case NC_DOUBLE:
-                    ((double *)predicted_file->var[n].created_data)[i] = NAN;
-                    break;
-                }
-            }
+            if (!allocate_created_data(predicted_file, n, length))
+                goto discard;
 
             for (int forecast = ds->start_prediction; forecast <= ds->end_prediction; forecast++)
             {
@@ -1205,20 +1974,7 @@ void exhaustive_processing_dependent(NetCDF *file, DataSegment *ds)
 
                     if (!isnan(distance))
                     {
-                        if (found < ds->num_Na)
-                        {
-                            closest[found].window_index = analog;
-                            closest[found].distance = distance;
-                            found++;
-                            if (found == ds->num_Na)
-                                qsort(closest, ds->num_Na, sizeof(ClosestPoint), compare_closest_point_ord_const);
-                        }
-                        else if (distance < closest[0].distance)
-                        {
-                            closest[0].window_index = analog;
-                            closest[0].distance = distance;
-                            qsort(closest, ds->num_Na, sizeof(ClosestPoint), compare_closest_point_ord_const);
-                        }
+                        topk_push(closest, &found, ds->num_Na, analog, distance);
                     }
                 }
 
@@ -1239,6 +1995,13 @@ void exhaustive_processing_dependent(NetCDF *file, DataSegment *ds)
             predicted_file->var[n].rmse = NAN;
         }
         printf("%.3lf,", predicted_file->var[n].rmse);
+
+        release_processing_variable(file, ds, n);
+        continue;
+
+    discard:
+        // Saída antecipada: libera a variável sem a série incompleta
+        discard_processing_variable(file, ds, n);
     }
 }
 
@@ -1277,9 +2040,7 @@ void partial_processing_independent_fixed_parallel(NetCDF *file, DataSegment *ds
  */
 MultiSeriesNodePool *create_multiseries_node_pool()
 {
-    MultiSeriesNodePool *pool = (MultiSeriesNodePool *)malloc(sizeof(MultiSeriesNodePool));
-    pool->next_available = 0;
-    return pool;
+    return node_arena_create(sizeof(KDTreeMultiSeries));
 }
 
 /**
@@ -1287,25 +2048,218 @@ MultiSeriesNodePool *create_multiseries_node_pool()
  */
 KDTreeMultiSeries *allocate_multiseries_node_from_pool(MultiSeriesNodePool *pool, int window_id, int total_dims)
 {
-    if (pool->next_available >= NODE_POOL_SIZE)
-    {
-        // Pool cheio, usar malloc como fallback
-        KDTreeMultiSeries *node = (KDTreeMultiSeries *)malloc(sizeof(KDTreeMultiSeries));
-        node->window_id = window_id;
-        node->total_dimensions = total_dims;
-        node->left = NULL;
-        node->right = NULL;
-        return node;
-    }
-
-    KDTreeMultiSeries *node = &(pool->nodes[pool->next_available++]);
+    KDTreeMultiSeries *node = (KDTreeMultiSeries *)node_arena_alloc(pool);
     node->window_id = window_id;
     node->total_dimensions = total_dims;
+    node->row = -1;
     node->left = NULL;
     node->right = NULL;
     return node;
 }
 
+/**
+ * @brief Valor de uma posição da série, em double
+ */
+static double series_value(Variable *var, int position)
+{
+    switch (var->type)
+    {
+        WINDOW_VALUE(NC_BYTE);
+        WINDOW_VALUE(NC_CHAR);
+        WINDOW_VALUE(NC_SHORT);
+        WINDOW_VALUE(NC_INT);
+        WINDOW_VALUE(NC_FLOAT);
+        WINDOW_VALUE(NC_DOUBLE);
+        WINDOW_VALUE(NC_UBYTE);
+        WINDOW_VALUE(NC_USHORT);
+        WINDOW_VALUE(NC_UINT);
+        WINDOW_VALUE(NC_INT64);
+        WINDOW_VALUE(NC_UINT64);
+    default:
+        return NAN;
+    }
+}
+
+/**
+ * @brief Aloca uma super janela no layout (e alinhamento) da matriz
+ */
+void *alloc_super_window(const SuperWindowMatrix *m)
+{
+    size_t bytes = m->stride * window_matrix_size(m);
+    void *window = aligned_alloc(STORE_ALIGNMENT, bytes);
+
+    if (!window)
+    {
+        fprintf(stderr, "Erro: Falha na alocação da super janela\n");
+        exit(1);
+    }
+
+    // Preenchimento zerado: as distâncias só leem as dim primeiras posições
+    memset(window, 0, bytes);
+    return window;
+}
+
+/**
+ * @brief Copia a super janela centrada em window_id para out
+ *
+ * Dimensão d = série x win_size + posição (sequencial) ou
+ * posição x séries + série (entrelaçada).
+ */
+void fill_super_window(const SuperWindowMatrix *m, NetCDF *file, DataSegment *ds, int n, int window_id, void *out)
+{
+    int num_series = ds->argc - 1;
+
+    for (int s = 0; s < num_series; s++)
+    {
+        Variable *var = &file[s + 1].var[n];
+
+        for (int j = 0; j < ds->win_size; j++)
+        {
+            int d = m->interleaved ? j * num_series + s : s * ds->win_size + j;
+            double value = series_value(var, window_id - ds->k + j);
+
+            if (m->type == NC_DOUBLE)
+                ((double *)out)[d] = value;
+            else if (m->type == NC_SHORT)
+            {
+                // Forecasts fora da faixa do treino saturam
+                double q = nearbyint((value - m->offset) / m->scale);
+                ((short *)out)[d] = (short)(q > 32767 ? 32767 : q < -32767 ? -32767 : q);
+            }
+            else
+                ((float *)out)[d] = (float)value;
+        }
+    }
+}
+
+/**
+ * @brief Materializa as super janelas dos analogs válidos
+ *
+ * A linha r corresponde a window_ids[r]; a KD-Tree é construída sobre
+ * os índices das linhas.
+ */
+SuperWindowMatrix *build_window_matrix(NetCDF *file, DataSegment *ds, int n, const int *window_ids,
+                                       int count, bool interleaved)
+{
+    SuperWindowMatrix *m = (SuperWindowMatrix *)malloc(sizeof(SuperWindowMatrix));
+    if (!m)
+    {
+        fprintf(stderr, "Erro: Falha na alocação da matriz de super janelas\n");
+        exit(1);
+    }
+
+    m->type = ds->window_matrix == NC_DOUBLE || ds->window_matrix == NC_SHORT ? ds->window_matrix : NC_FLOAT;
+    if (ds->window_matrix == WINDOW_MATRIX_AUTO)
+        for (int s = 0; s < ds->argc - 1; s++)
+            if (file[s + 1].var[n].type != NC_FLOAT)
+                m->type = NC_DOUBLE;
+    m->interleaved = interleaved;
+    m->scale = 1.0;
+    m->offset = 0.0;
+
+    size_t size = window_matrix_size(m);
+    size_t per_line = STORE_ALIGNMENT / size;
+
+    // Escala única da variável: faixa dos valores de todas as séries preditoras
+    if (m->type == NC_SHORT)
+    {
+        double min = INFINITY, max = -INFINITY;
+
+        for (int s = 0; s < ds->argc - 1; s++)
+            for (size_t j = 0; j < file[s + 1].dim->len; j++)
+            {
+                double value = series_value(&file[s + 1].var[n], j);
+                if (value < min)
+                    min = value;
+                if (value > max)
+                    max = value;
+            }
+
+        if (max > min)
+        {
+            m->offset = (min + max) / 2;
+            m->scale = (max - min) / 65534;
+        }
+        else if (min == max)
+            m->offset = min;
+    }
+
+    m->rows = count;
+    m->dim = ds->win_size * (ds->argc - 1);
+    m->stride = (m->dim + per_line - 1) / per_line * per_line;
+    m->window_ids = (int *)malloc(count * sizeof(int));
+    m->data = aligned_alloc(STORE_ALIGNMENT, (size_t)count * m->stride * size);
+
+    if (!m->window_ids || !m->data)
+    {
+        fprintf(stderr, "Erro: Falha na alocação da matriz de super janelas (%d x %zu)\n", count, m->stride);
+        exit(1);
+    }
+
+    memcpy(m->window_ids, window_ids, count * sizeof(int));
+    memset(m->data, 0, (size_t)count * m->stride * size);
+
+    for (int r = 0; r < count; r++)
+        fill_super_window(m, file, ds, n, window_ids[r], (char *)m->data + (size_t)r * m->stride * size);
+
+    return m;
+}
+
+/**
+ * @brief Libera a matriz de super janelas
+ */
+void free_window_matrix(SuperWindowMatrix *m)
+{
+    if (!m)
+        return;
+
+    free(m->window_ids);
+    free(m->data);
+    free(m);
+}
+
+/**
+ * @brief Distância quadrática entre uma super janela e a linha row
+ *
+ * Uma única passada contígua de dim valores pelos kernels de distance.h.
+ */
+double window_matrix_sqdist(const SuperWindowMatrix *m, const void *target, int row)
+{
+    if (m->type == NC_DOUBLE)
+        return sqdist_double((const double *)target, (const double *)window_matrix_row(m, row), m->dim);
+
+    if (m->type == NC_SHORT)
+        return sqdist_short((const short *)target, (const short *)window_matrix_row(m, row), m->dim) *
+               m->scale * m->scale;
+
+    return sqdist_float((const float *)target, (const float *)window_matrix_row(m, row), m->dim);
+}
+
+/**
+ * @brief Re-ranqueia os candidatos de uma busca quantizada
+ *
+ * Recalcula a distância de cada candidato a partir das séries originais
+ * (mesma métrica da busca exata) e deixa em closest[0..num_Na) os
+ * num_Na mais próximos, para recreate_data.
+ *
+ * @return Quantidade de vizinhos (no máximo ds->num_Na)
+ */
+static int rerank_candidates(NetCDF *file, DataSegment *ds, int n, int forecast, ClosestPoint *closest, int found)
+{
+    for (int i = 0; i < found; i++)
+        closest[i].distance = sqrt(series_sqdist(file, 1, ds->argc, n, forecast - ds->k,
+                                                 closest[i].window_index - ds->k, ds->win_size));
+
+    // Ordem decrescente: os num_Na mais próximos ficam no fim
+    qsort(closest, found, sizeof(ClosestPoint), compare_closest_point_ord_const);
+
+    if (found <= ds->num_Na)
+        return found;
+
+    memmove(closest, &closest[found - ds->num_Na], ds->num_Na * sizeof(ClosestPoint));
+    return ds->num_Na;
+}
+
 /**
  * @brief Obtém valor de uma dimensão específica da super janela
  *
@@ -1322,6 +2276,10 @@ double get_multiseries_value(NetCDF *file, DataSegment *ds, int window_id, int d
     // As outras séries são file[1], file[2], etc.
     int file_idx = (series_idx == 0) ? 1 : 1 + (series_idx % (ds->argc - 1));
 
+    // Armazenamento normalizado: acesso direto, sem despacho por tipo
+    if (ds->store_type == NC_FLOAT)
+        return (double)((float *)file[file_idx].var[var_idx].data)[(window_id - ds->k) + pos_in_window];
+
     switch (file[file_idx].var[var_idx].type)
     {
     case NC_FLOAT:
@@ -1363,8 +2321,31 @@ int compare_multiseries_points(const void *a, const void *b)
     return 0;
 }
 
+/**
+ * @brief Função de comparação para linhas da matriz de super janelas
+ */
+int compare_window_matrix_rows(const void *a, const void *b)
+{
+    if (!current_sort_context)
+        return 0;
+
+    const SuperWindowMatrix *m = current_sort_context->ds->windows;
+    int axis = current_sort_context->axis;
+
+    double val_a = window_matrix_value(m, window_matrix_row(m, *(const int *)a), axis);
+    double val_b = window_matrix_value(m, window_matrix_row(m, *(const int *)b), axis);
+
+    if (val_a < val_b)
+        return -1;
+    if (val_a > val_b)
+        return 1;
+    return 0;
+}
+
 /**
  * @brief Ordena pontos por eixo para múltiplas séries (versão compatível)
+ *
+ * Com ds->windows, points são linhas da matriz.
  */
 void sort_multiseries_points_by_axis(int *points, int n, NetCDF *file, DataSegment *ds, int axis, int var_idx)
 {
@@ -1372,7 +2353,7 @@ void sort_multiseries_points_by_axis(int *points, int n, NetCDF *file, DataSegme
 
     // Usar variável thread-local para passar contexto
     current_sort_context = &ctx;
-    qsort(points, n, sizeof(int), compare_multiseries_points);
+    qsort(points, n, sizeof(int), ds->windows ? compare_window_matrix_rows : compare_multiseries_points);
     current_sort_context = NULL;
 }
 
@@ -1393,64 +2374,34 @@ KDTreeMultiSeries *build_multiseries_balanced_kdtree(int *window_ids, int n, Net
 
     int median_idx = n / 2;
 
-    // Criar nó com ponto mediano
-    KDTreeMultiSeries *node = allocate_multiseries_node_from_pool(pool, window_ids[median_idx], total_dimensions);
+    // Criar nó com ponto mediano (com ds->windows, window_ids são linhas da matriz)
+    int window_id = ds->windows ? ds->windows->window_ids[window_ids[median_idx]] : window_ids[median_idx];
+    KDTreeMultiSeries *node = allocate_multiseries_node_from_pool(pool, window_id, total_dimensions);
+    node->row = ds->windows ? window_ids[median_idx] : -1;
 
     // Construir subárvores recursivamente
     node->left = build_multiseries_balanced_kdtree(window_ids, median_idx, file, ds, depth + 1, pool, var_idx);
     node->right = build_multiseries_balanced_kdtree(&window_ids[median_idx + 1], n - median_idx - 1,
                                                     file, ds, depth + 1, pool, var_idx);
 
-    return node;
-}
-
-/**
- * @brief Calcula distância quadrática entre super janelas (múltiplas séries)
- */
-double squared_distance_multiseries(KDTreeMultiSeries *root, NetCDF *file, DataSegment *ds,
-                                    int target_id, int node_id, int var_idx)
-{
-    double sum = 0.0;
-
-    // Calcular distância em todas as dimensões (todas as séries)
-    for (int series = 0; series < (ds->argc - 1); series++)
-    {
-        int file_idx = series + 1; // file[1], file[2], etc.
-
-        switch (file[file_idx].var[var_idx].type)
-        {
-        case NC_FLOAT:
-        {
-            float *data = (float *)file[file_idx].var[var_idx].data;
-            for (int x = 0; x < ds->win_size; x++)
-            {
-                float diff = data[(target_id - ds->k) + x] - data[(node_id - ds->k) + x];
-                sum += diff * diff;
-
-                // Early termination se já excedeu a melhor distância
-                if (sum > ds->current_best_distance && ds->current_best_distance > 0)
-                {
-                    return INFINITY;
-                }
-            }
-            break;
-        }
-        case NC_DOUBLE:
-        {
-            double *data = (double *)file[file_idx].var[var_idx].data;
-            for (int x = 0; x < ds->win_size; x++)
-            {
-                double diff = data[(target_id - ds->k) + x] - data[(node_id - ds->k) + x];
-                sum += diff * diff;
+    return node;
+}
 
-                if (sum > ds->current_best_distance && ds->current_best_distance > 0)
-                {
-                    return INFINITY;
-                }
-            }
-            break;
-        }
-        }
+/**
+ * @brief Calcula distância quadrática entre super janelas (múltiplas séries)
+ */
+double squared_distance_multiseries(KDTreeMultiSeries *root, NetCDF *file, DataSegment *ds,
+                                    int target_id, int node_id, int var_idx)
+{
+    // Calcular distância em todas as dimensões (todas as séries: file[1], file[2], etc.),
+    // numa passada contígua quando há matriz de super janelas
+    double sum = ds->windows ? window_matrix_sqdist(ds->windows, ds->target_window, root->row)
+                             : series_sqdist(file, 1, ds->argc, var_idx, target_id - ds->k, node_id - ds->k, ds->win_size);
+
+    // Early termination se já excedeu a melhor distância
+    if (sum > ds->current_best_distance && ds->current_best_distance > 0)
+    {
+        return INFINITY;
     }
 
     return sum;
@@ -1476,30 +2427,15 @@ void search_multiseries_closest_points(KDTreeMultiSeries *root, NetCDF *file, Da
     {
         double distance = sqrt(squared_dist);
 
-        if (*found < ds->num_Na)
-        {
-            closest[*found].window_index = root->window_id;
-            closest[*found].distance = distance;
-            (*found)++;
-
-            if (*found == ds->num_Na)
-            {
-                qsort(closest, ds->num_Na, sizeof(ClosestPoint), compare_closest_point_ord_const);
-                ds->current_best_distance = closest[0].distance * closest[0].distance;
-            }
-        }
-        else if (distance < closest[0].distance)
-        {
-            closest[0].window_index = root->window_id;
-            closest[0].distance = distance;
-            qsort(closest, ds->num_Na, sizeof(ClosestPoint), compare_closest_point_ord_const);
+        if (topk_push(closest, found, ds->num_Na, root->window_id, distance) && *found == ds->num_Na)
             ds->current_best_distance = closest[0].distance * closest[0].distance;
-        }
     }
 
     // Determinar ordem de visita dos filhos
-    double target_val = get_multiseries_value(file, ds, target_id, axis, var_idx);
-    double node_val = get_multiseries_value(file, ds, root->window_id, axis, var_idx);
+    double target_val = ds->windows ? window_matrix_value(ds->windows, ds->target_window, axis)
+                                    : get_multiseries_value(file, ds, target_id, axis, var_idx);
+    double node_val = ds->windows ? window_matrix_value(ds->windows, window_matrix_row(ds->windows, root->row), axis)
+                                  : get_multiseries_value(file, ds, root->window_id, axis, var_idx);
 
     KDTreeMultiSeries *first_child, *second_child;
     if (target_val < node_val)
@@ -1550,13 +2486,21 @@ void *kdanen_dependent_parallel_worker(void *arg)
     // Criar DataSegment local para thread safety
     DataSegment local_ds = *shared->ds;
 
+    // Super janela do forecast no layout da matriz (uma por thread)
+    local_ds.target_window = local_ds.windows ? alloc_super_window(local_ds.windows) : NULL;
+
+    // Matriz quantizada: busca window_overfetch candidatos por vizinho
+    bool rerank = local_ds.windows && local_ds.windows->type == NC_SHORT && shared->ds->window_overfetch > 1;
+    if (rerank)
+        local_ds.num_Na = shared->ds->num_Na * shared->ds->window_overfetch;
+
     // Processar forecasts atribuídos a esta thread
     for (int f_idx = worker->start_forecast_idx; f_idx < worker->end_forecast_idx; f_idx++)
     {
         int forecast = shared->valid_forecasts[f_idx];
 
         // Alocar estrutura de candidatos (thread-local)
-        ClosestPoint *closest = allocate_closest_points_safe(shared->ds->num_Na);
+        ClosestPoint *closest = allocate_closest_points_safe(local_ds.num_Na);
         if (!closest)
         {
             fprintf(stderr, "[Thread %d] Erro na alocação de ClosestPoint\n", worker->thread_id);
@@ -1566,10 +2510,17 @@ void *kdanen_dependent_parallel_worker(void *arg)
         int found = 0;
         local_ds.current_best_distance = INFINITY;
 
+        if (local_ds.windows)
+            fill_super_window(local_ds.windows, shared->predictor_file, &local_ds, shared->n, forecast,
+                              local_ds.target_window);
+
         // Usar KD-Tree de múltiplas séries para busca eficiente
         search_multiseries_closest_points(shared->root, shared->predictor_file, &local_ds,
                                           closest, forecast, 0, shared->n, &found);
 
+        if (rerank)
+            found = rerank_candidates(shared->predictor_file, shared->ds, shared->n, forecast, closest, found);
+
         // Reconstruir dados (thread-safe)
         int created_data_index = forecast - shared->ds->start_prediction;
         gettimeofday(&rec_start, 0);
@@ -1583,6 +2534,8 @@ void *kdanen_dependent_parallel_worker(void *arg)
         worker->processed_count++;
     }
 
+    free(local_ds.target_window);
+
     gettimeofday(&worker_end, 0);
     worker->processing_time = (worker_end.tv_sec - worker_start.tv_sec) +
                               (worker_end.tv_usec - worker_start.tv_usec) * 1e-6;
@@ -1590,6 +2543,159 @@ void *kdanen_dependent_parallel_worker(void *arg)
     return NULL;
 }
 
+/**
+ * @brief Reconstrói os forecasts de [start_prediction, end_prediction]
+ *
+ * Coleta os forecasts válidos em todas as séries preditoras e distribui a
+ * busca na KD-Tree do treino entre as threads. created_data da variável
+ * n deve cobrir o mesmo intervalo.
+ *
+ * @return Tempo da etapa paralela (s), ou -1 sem forecasts válidos
+ */
+static double kdanen_dependent_forecasts(NetCDF *file, DataSegment *ds, int n, KDTreeMultiSeries *root)
+{
+    NetCDF *predicted_file = &file[0];
+
+    // ========== COLETAR FORECASTS VÁLIDOS ==========
+    int total_forecasts = ds->end_prediction - ds->start_prediction + 1;
+    int *valid_forecasts = (int *)malloc(total_forecasts * sizeof(int));
+    int num_valid_forecasts = 0;
+
+    if (!valid_forecasts)
+        return -1;
+
+    // Validar forecasts em TODAS as séries preditoras (AND dos índices de validade)
+    num_valid_forecasts = collect_valid_windows(file, 1, ds->argc, n, ds->start_prediction,
+                                                ds->end_prediction, valid_forecasts);
+
+    if (num_valid_forecasts == 0)
+    {
+        free(valid_forecasts);
+        return -1;
+    }
+
+    // ========== PROCESSAMENTO PARALELO ==========
+    struct timeval begin_parallel, end_parallel;
+    gettimeofday(&begin_parallel, 0);
+
+    // Configurar dados compartilhados
+    KDANENDependentSharedData shared_data;
+    shared_data.predicted_file = predicted_file;
+    shared_data.predictor_file = file; // Array completo para acesso a todas as séries
+    shared_data.ds = ds;
+    shared_data.n = n;
+    shared_data.root = root;
+    shared_data.valid_forecasts = valid_forecasts;
+    shared_data.num_valid_forecasts = num_valid_forecasts;
+    shared_data.total_dimensions = ds->win_size * (ds->argc - 1);
+
+    // Configurar threads
+    pthread_t threads[ds->num_thread];
+    KDANENDependentWorkerData workers[ds->num_thread];
+
+    // Distribuir trabalho entre threads
+    int forecasts_per_thread = num_valid_forecasts / ds->num_thread;
+    int remaining_forecasts = num_valid_forecasts % ds->num_thread;
+
+    // Criar e iniciar threads
+    for (int t = 0; t < ds->num_thread; t++)
+    {
+        workers[t].shared = &shared_data;
+        workers[t].thread_id = t;
+        workers[t].start_forecast_idx = t * forecasts_per_thread;
+        workers[t].end_forecast_idx = (t + 1) * forecasts_per_thread;
+        workers[t].processed_count = 0;
+        workers[t].reconstruct_time = 0.0;
+        workers[t].processing_time = 0.0;
+
+        // Última thread pega os forecasts restantes
+        if (t == ds->num_thread - 1)
+        {
+            workers[t].end_forecast_idx += remaining_forecasts;
+        }
+
+        if (pthread_create(&threads[t], NULL, kdanen_dependent_parallel_worker, &workers[t]) != 0)
+        {
+            fprintf(stderr, "Erro ao criar thread %d\n", t);
+            exit(1);
+        }
+    }
+
+    // Aguardar todas as threads terminarem
+    for (int t = 0; t < ds->num_thread; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+    
+    gettimeofday(&end_parallel, 0);
+    double parallel_time = (end_parallel.tv_sec - begin_parallel.tv_sec) +
+    (end_parallel.tv_usec - begin_parallel.tv_usec) * 1e-6;
+
+    free(valid_forecasts);
+    return parallel_time;
+}
+
+/**
+ * @brief Predição em blocos de ds->prediction_chunk pontos
+ *
+ * Para cada bloco: carrega e pré-processa os forecasts (com halo) em
+ * todos os arquivos, reconstrói contra a KD-Tree do treino (residente),
+ * acumula o RMSE, envia o bloco ao ds->writer e libera a memória do
+ * bloco. A memória fica O(treino + bloco), e não O(período inteiro).
+ *
+ * @return Tempo somado das etapas paralelas (s)
+ */
+static double kdanen_dependent_chunks(NetCDF *file, DataSegment *ds, int n, KDTreeMultiSeries *root,
+                                      double *sum_error, int *count, bool *valid)
+{
+    NetCDF *predicted_file = &file[0];
+    Variable *var = &predicted_file->var[n];
+    double parallel_time = 0;
+
+    for (int start = ds->start_prediction; start <= ds->end_prediction; start += ds->prediction_chunk)
+    {
+        DataSegment chunk = *ds;
+        chunk.start_prediction = start;
+        chunk.end_prediction = start + ds->prediction_chunk - 1 < ds->end_prediction
+                                   ? start + ds->prediction_chunk - 1
+                                   : ds->end_prediction;
+        unsigned int length = (chunk.end_prediction - chunk.start_prediction) + 1;
+        bool last = chunk.end_prediction == ds->end_prediction;
+
+        for (int f = 0; f < ds->argc; f++)
+            preprocess_chunk(&file[f], ds, n, chunk.start_prediction, chunk.end_prediction);
+
+        if (!allocate_created_data(predicted_file, n, length))
+        {
+            fprintf(stderr, "Erro: Falha ao alocar o bloco da variável %d\n", n);
+            exit(1);
+        }
+
+        double chunk_time = kdanen_dependent_forecasts(file, &chunk, n, root);
+        if (chunk_time >= 0)
+            parallel_time += chunk_time;
+
+        accumulate_rmse(predicted_file, &chunk, n, sum_error, count);
+        *valid = validate_reconstruction_process(predicted_file, &chunk, n) || *valid;
+
+        // O RMSE precisa estar completo quando o último bloco é enviado
+        if (last)
+            var->rmse = *valid && *count > 0 ? sqrt(*sum_error / *count) : NAN;
+
+        if (ds->writer)
+            ncwriter_submit_range(ds->writer, predicted_file, n,
+                                  chunk.start_prediction - ds->start_prediction, length);
+        else
+            free(var->created_data);
+        var->created_data = NULL;
+
+        for (int f = 0; f < ds->argc; f++)
+            release_chunk(&file[f], ds, n, chunk.end_prediction + 1);
+    }
+
+    return parallel_time;
+}
+
 /**
  * @brief Algoritmo KD-ANEN Dependent Paralelo - KD-Tree para múltiplas séries
  *
@@ -1600,7 +2706,6 @@ void *kdanen_dependent_parallel_worker(void *arg)
 void kdanen_dependent_parallel(NetCDF *file, DataSegment *ds)
 {
     NetCDF *predicted_file = &file[0];
-    NetCDF *predictor_file = &file[1]; // Primeira série preditora como referência
 
     // Criar pool global de nós
     MultiSeriesNodePool *global_pool = create_multiseries_node_pool();
@@ -1612,6 +2717,12 @@ void kdanen_dependent_parallel(NetCDF *file, DataSegment *ds)
 
     for (int n = 1; n - 1 < predicted_file->nvars - 13; n++)
     {
+        double chunk_sum = 0;
+        int chunk_count = 0;
+        bool chunk_valid = false;
+
+        acquire_processing_variable(file, ds, n);
+
         if (predicted_file->var[n].invalid_percentage <= (double)15 &&
             predicted_file->var[n].invalid_percentage != (double)0)
         {
@@ -1619,46 +2730,14 @@ void kdanen_dependent_parallel(NetCDF *file, DataSegment *ds)
             unsigned int length = (ds->end_prediction - ds->start_prediction) + 1;
 
             // Reset do pool para esta iteração
-            global_pool->next_available = 0;
-
-            // ========== ALOCAÇÃO DE MEMÓRIA ==========
-            switch (predictor_file->var[n].type)
-            {
-                ALLOCATE_MEMORY_REC_DATA(NC_BYTE, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_CHAR, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_SHORT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_INT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_FLOAT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_DOUBLE, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_UBYTE, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_USHORT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_UINT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_INT64, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_UINT64, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_STRING, length);
-            default:
-                predicted_file->var[n].created_data = malloc(length * sizeof(float));
-                break;
-            }
-
-            if (!predicted_file->var[n].created_data)
-                continue;
+            node_arena_reset(global_pool);
 
-            // Inicializar com NaN
-            for (int i = 0; i < length; i++)
+            // Com predição em blocos, created_data é alocado por bloco
+            if (ds->prediction_chunk == 0)
             {
-                switch (predictor_file->var[n].type)
-                {
-                case NC_FLOAT:
-                    ((float *)predicted_file->var[n].created_data)[i] = NAN;
-                    break;
-                case NC_DOUBLE:
-                    ((double *)predicted_file->var[n].created_data)[i] = NAN;
-                    break;
-                default:
-                    ((float *)predicted_file->var[n].created_data)[i] = NAN;
-                    break;
-                }
+                // ========== ALOCAÇÃO DE MEMÓRIA ==========
+                if (!allocate_created_data(predicted_file, n, length))
+                    goto discard;
             }
 
             // ========== CONSTRUIR KD-TREE PARA MÚLTIPLAS SÉRIES ==========
@@ -1671,39 +2750,36 @@ void kdanen_dependent_parallel(NetCDF *file, DataSegment *ds)
             int valid_training_points = 0;
 
             if (!training_indices)
-                continue;
-
-            // Validar janelas em TODAS as séries preditoras (como no anen_dependent)
-            for (int analog = ds->start_training; analog <= ds->end_training; analog++)
-            {
-                bool all_series_valid = true;
+                goto discard;
 
-                for (int series = 1; series < ds->argc && all_series_valid; series++)
-                {
-                    if (!validate_window_simple(&file[series].var[n], analog, ds->k,
-                                                ds->win_size, file[series].dim->len))
-                    {
-                        all_series_valid = false;
-                    }
-                }
+            // Validar janelas em TODAS as séries preditoras (como no anen_dependent),
+            // com AND dos índices de validade
+            valid_training_points = collect_valid_windows(file, 1, ds->argc, n, ds->start_training,
+                                                          ds->end_training, training_indices);
 
-                if (all_series_valid)
-                {
-                    training_indices[valid_training_points++] = analog;
-                }
+            // Matriz de super janelas do treino: a árvore passa a indexar linhas
+            free_window_matrix(ds->windows);
+            ds->windows = NULL;
+            if (ds->window_matrix && valid_training_points > 0)
+            {
+                ds->windows = build_window_matrix(file, ds, n, training_indices, valid_training_points, false);
+                for (int r = 0; r < valid_training_points; r++)
+                    training_indices[r] = r;
             }
 
             // Construir KD-Tree balanceada para múltiplas séries
             KDTreeMultiSeries *root = NULL;
             if (valid_training_points > 0)
             {
+                // Um nó por janela válida, num bloco só
+                node_arena_reserve(global_pool, valid_training_points);
                 root = build_multiseries_balanced_kdtree(training_indices, valid_training_points,
                                                          file, ds, 0, global_pool, n);
             }
 
             free(training_indices);
             if (!root)
-                continue;
+                goto discard;
 
             gettimeofday(&end_tree, 0);
             double kdtree_time = (end_tree.tv_sec - begin_tree.tv_sec) +
@@ -1711,105 +2787,36 @@ void kdanen_dependent_parallel(NetCDF *file, DataSegment *ds)
 
             printf("%.3f-,", kdtree_time);
 
-            // ========== COLETAR FORECASTS VÁLIDOS ==========
-            int total_forecasts = ds->end_prediction - ds->start_prediction + 1;
-            int *valid_forecasts = (int *)malloc(total_forecasts * sizeof(int));
-            int num_valid_forecasts = 0;
-
-            if (!valid_forecasts)
-                continue;
+            double parallel_time;
 
-            // Validar forecasts em TODAS as séries preditoras
-            for (int forecast = ds->start_prediction; forecast <= ds->end_prediction; forecast++)
+            if (ds->prediction_chunk > 0)
             {
-                bool all_series_valid = true;
-
-                for (int series = 1; series < ds->argc && all_series_valid; series++)
-                {
-                    if (!validate_window_simple(&file[series].var[n], forecast, ds->k,
-                                                ds->win_size, file[series].dim->len))
-                    {
-                        all_series_valid = false;
-                    }
-                }
-
-                if (all_series_valid)
-                {
-                    valid_forecasts[num_valid_forecasts++] = forecast;
-                }
+                parallel_time = kdanen_dependent_chunks(file, ds, n, root, &chunk_sum, &chunk_count, &chunk_valid);
             }
-
-            if (num_valid_forecasts == 0)
+            else
             {
-                free(valid_forecasts);
-                continue;
+                parallel_time = kdanen_dependent_forecasts(file, ds, n, root);
+                if (parallel_time < 0)
+                    goto discard;
             }
 
-            // ========== PROCESSAMENTO PARALELO ==========
-            struct timeval begin_parallel, end_parallel;
-            gettimeofday(&begin_parallel, 0);
-
-            // Configurar dados compartilhados
-            KDANENDependentSharedData shared_data;
-            shared_data.predicted_file = predicted_file;
-            shared_data.predictor_file = file; // Array completo para acesso a todas as séries
-            shared_data.ds = ds;
-            shared_data.n = n;
-            shared_data.root = root;
-            shared_data.valid_forecasts = valid_forecasts;
-            shared_data.num_valid_forecasts = num_valid_forecasts;
-            shared_data.total_dimensions = ds->win_size * (ds->argc - 1);
-
-            // Configurar threads
-            pthread_t threads[ds->num_thread];
-            KDANENDependentWorkerData workers[ds->num_thread];
-
-            // Distribuir trabalho entre threads
-            int forecasts_per_thread = num_valid_forecasts / ds->num_thread;
-            int remaining_forecasts = num_valid_forecasts % ds->num_thread;
+            printf("%.3f-,", parallel_time);
+        }
 
-            // Criar e iniciar threads
-            for (int t = 0; t < ds->num_thread; t++)
+        // Calcular RMSE (sequencial); em blocos, já acumulado por bloco
+        if (ds->prediction_chunk > 0)
+        {
+            if (chunk_valid)
             {
-                workers[t].shared = &shared_data;
-                workers[t].thread_id = t;
-                workers[t].start_forecast_idx = t * forecasts_per_thread;
-                workers[t].end_forecast_idx = (t + 1) * forecasts_per_thread;
-                workers[t].processed_count = 0;
-                workers[t].reconstruct_time = 0.0;
-                workers[t].processing_time = 0.0;
-
-                // Última thread pega os forecasts restantes
-                if (t == ds->num_thread - 1)
-                {
-                    workers[t].end_forecast_idx += remaining_forecasts;
-                }
-
-                if (pthread_create(&threads[t], NULL, kdanen_dependent_parallel_worker, &workers[t]) != 0)
-                {
-                    fprintf(stderr, "Erro ao criar thread %d\n", t);
-                    exit(1);
-                }
+                printf("%.3lf,", predicted_file->var[n].rmse);
             }
-
-            // Aguardar todas as threads terminarem
-            for (int t = 0; t < ds->num_thread; t++)
+            else
             {
-                pthread_join(threads[t], NULL);
+                predicted_file->var[n].rmse = NAN;
+                printf("NaN,");
             }
-            
-            gettimeofday(&end_parallel, 0);
-            double parallel_time = (end_parallel.tv_sec - begin_parallel.tv_sec) +
-            (end_parallel.tv_usec - begin_parallel.tv_usec) * 1e-6;
-            
-            printf("%.3f-,", parallel_time);
-
-            // ========== LIMPEZA ==========
-            free(valid_forecasts);
         }
-
-        // Calcular RMSE (sequencial)
-        if (validate_reconstruction_process(predicted_file, ds, n))
+        else if (validate_reconstruction_process(predicted_file, ds, n))
         {
             calculate_rmse(predicted_file, ds, n);
             printf("%.3lf,", predicted_file->var[n].rmse);
@@ -1819,10 +2826,19 @@ void kdanen_dependent_parallel(NetCDF *file, DataSegment *ds)
             predicted_file->var[n].rmse = NAN;
             printf("NaN,");
         }
+
+        release_processing_variable(file, ds, n);
+        continue;
+
+    discard:
+        // Saída antecipada: libera a variável sem a série incompleta
+        discard_processing_variable(file, ds, n);
     }
 
     // Liberar pool global
-    free(global_pool);
+    free_window_matrix(ds->windows);
+    ds->windows = NULL;
+    node_arena_free(global_pool);
 }
 
 // =============================================================================
@@ -1847,6 +2863,10 @@ double get_multiseries_value_interleaved(NetCDF *file, DataSegment *ds, int wind
     int series_idx = dimension % num_series;    // ⭐ MUDANÇA: Série depois
     int file_idx = series_idx + 1;              // file[1], file[2], etc.
 
+    // Armazenamento normalizado: acesso direto, sem despacho por tipo
+    if (ds->store_type == NC_FLOAT)
+        return (double)((float *)file[file_idx].var[var_idx].data)[(window_id - ds->k) + pos_in_window];
+
     switch (file[file_idx].var[var_idx].type)
     {
     case NC_FLOAT:
@@ -1897,7 +2917,7 @@ void sort_multiseries_points_by_axis_interleaved(int *points, int n, NetCDF *fil
 
     // Usar variável thread-local para passar contexto
     current_sort_context = &ctx;
-    qsort(points, n, sizeof(int), compare_multiseries_standard_interleaved);
+    qsort(points, n, sizeof(int), ds->windows ? compare_window_matrix_rows : compare_multiseries_standard_interleaved);
     current_sort_context = NULL;
 }
 
@@ -1918,8 +2938,10 @@ KDTreeMultiSeries *build_multiseries_balanced_kdtree_interleaved(int *window_ids
 
     int median_idx = n / 2;
 
-    // Criar nó com ponto mediano
-    KDTreeMultiSeries *node = allocate_multiseries_node_from_pool(pool, window_ids[median_idx], total_dimensions);
+    // Criar nó com ponto mediano (com ds->windows, window_ids são linhas da matriz)
+    int window_id = ds->windows ? ds->windows->window_ids[window_ids[median_idx]] : window_ids[median_idx];
+    KDTreeMultiSeries *node = allocate_multiseries_node_from_pool(pool, window_id, total_dimensions);
+    node->row = ds->windows ? window_ids[median_idx] : -1;
 
     // Construir subárvores recursivamente
     node->left = build_multiseries_balanced_kdtree_interleaved(window_ids, median_idx, file, ds, depth + 1, pool, var_idx);
@@ -1938,47 +2960,15 @@ KDTreeMultiSeries *build_multiseries_balanced_kdtree_interleaved(int *window_ids
 double squared_distance_multiseries_interleaved(KDTreeMultiSeries *root, NetCDF *file, DataSegment *ds,
                                                 int target_id, int node_id, int var_idx)
 {
-    double sum = 0.0;
+    // Calcular distância em todas as dimensões (todas as séries: file[1], file[2], etc.),
+    // numa passada contígua quando há matriz de super janelas
+    double sum = ds->windows ? window_matrix_sqdist(ds->windows, ds->target_window, root->row)
+                             : series_sqdist(file, 1, ds->argc, var_idx, target_id - ds->k, node_id - ds->k, ds->win_size);
 
-    // Calcular distância em todas as dimensões (todas as séries)
-    for (int series = 0; series < (ds->argc - 1); series++)
+    // Early termination se já excedeu a melhor distância
+    if (sum > ds->current_best_distance && ds->current_best_distance > 0)
     {
-        int file_idx = series + 1; // file[1], file[2], etc.
-
-        switch (file[file_idx].var[var_idx].type)
-        {
-        case NC_FLOAT:
-        {
-            float *data = (float *)file[file_idx].var[var_idx].data;
-            for (int x = 0; x < ds->win_size; x++)
-            {
-                float diff = data[(target_id - ds->k) + x] - data[(node_id - ds->k) + x];
-                sum += diff * diff;
-
-                // Early termination se já excedeu a melhor distância
-                if (sum > ds->current_best_distance && ds->current_best_distance > 0)
-                {
-                    return INFINITY;
-                }
-            }
-            break;
-        }
-        case NC_DOUBLE:
-        {
-            double *data = (double *)file[file_idx].var[var_idx].data;
-            for (int x = 0; x < ds->win_size; x++)
-            {
-                double diff = data[(target_id - ds->k) + x] - data[(node_id - ds->k) + x];
-                sum += diff * diff;
-
-                if (sum > ds->current_best_distance && ds->current_best_distance > 0)
-                {
-                    return INFINITY;
-                }
-            }
-            break;
-        }
-        }
+        return INFINITY;
     }
 
     return sum;
@@ -2004,30 +2994,15 @@ void search_multiseries_closest_points_interleaved(KDTreeMultiSeries *root, NetC
     {
         double distance = sqrt(squared_dist);
 
-        if (*found < ds->num_Na)
-        {
-            closest[*found].window_index = root->window_id;
-            closest[*found].distance = distance;
-            (*found)++;
-
-            if (*found == ds->num_Na)
-            {
-                qsort(closest, ds->num_Na, sizeof(ClosestPoint), compare_closest_point_ord_const);
-                ds->current_best_distance = closest[0].distance * closest[0].distance;
-            }
-        }
-        else if (distance < closest[0].distance)
-        {
-            closest[0].window_index = root->window_id;
-            closest[0].distance = distance;
-            qsort(closest, ds->num_Na, sizeof(ClosestPoint), compare_closest_point_ord_const);
+        if (topk_push(closest, found, ds->num_Na, root->window_id, distance) && *found == ds->num_Na)
             ds->current_best_distance = closest[0].distance * closest[0].distance;
-        }
     }
 
     // Determinar ordem de visita dos filhos - USAR LAYOUT ENTRELAÇADO
-    double target_val = get_multiseries_value_interleaved(file, ds, target_id, axis, var_idx);
-    double node_val = get_multiseries_value_interleaved(file, ds, root->window_id, axis, var_idx);
+    double target_val = ds->windows ? window_matrix_value(ds->windows, ds->target_window, axis)
+                                    : get_multiseries_value_interleaved(file, ds, target_id, axis, var_idx);
+    double node_val = ds->windows ? window_matrix_value(ds->windows, window_matrix_row(ds->windows, root->row), axis)
+                                  : get_multiseries_value_interleaved(file, ds, root->window_id, axis, var_idx);
 
     KDTreeMultiSeries *first_child, *second_child;
     if (target_val < node_val)
@@ -2078,13 +3053,21 @@ void *kdanen_dependent_parallel_worker_interleaved(void *arg)
     // Criar DataSegment local para thread safety
     DataSegment local_ds = *shared->ds;
 
+    // Super janela do forecast no layout da matriz (uma por thread)
+    local_ds.target_window = local_ds.windows ? alloc_super_window(local_ds.windows) : NULL;
+
+    // Matriz quantizada: busca window_overfetch candidatos por vizinho
+    bool rerank = local_ds.windows && local_ds.windows->type == NC_SHORT && shared->ds->window_overfetch > 1;
+    if (rerank)
+        local_ds.num_Na = shared->ds->num_Na * shared->ds->window_overfetch;
+
     // Processar forecasts atribuídos a esta thread
     for (int f_idx = worker->start_forecast_idx; f_idx < worker->end_forecast_idx; f_idx++)
     {
         int forecast = shared->valid_forecasts[f_idx];
 
         // Alocar estrutura de candidatos (thread-local)
-        ClosestPoint *closest = allocate_closest_points_safe(shared->ds->num_Na);
+        ClosestPoint *closest = allocate_closest_points_safe(local_ds.num_Na);
         if (!closest)
         {
             fprintf(stderr, "[Thread %d] Erro na alocação de ClosestPoint\n", worker->thread_id);
@@ -2094,10 +3077,17 @@ void *kdanen_dependent_parallel_worker_interleaved(void *arg)
         int found = 0;
         local_ds.current_best_distance = INFINITY;
 
+        if (local_ds.windows)
+            fill_super_window(local_ds.windows, shared->predictor_file, &local_ds, shared->n, forecast,
+                              local_ds.target_window);
+
         // Usar KD-Tree de múltiplas séries para busca eficiente - LAYOUT ENTRELAÇADO
         search_multiseries_closest_points_interleaved(shared->root, shared->predictor_file, &local_ds,
                                                       closest, forecast, 0, shared->n, &found);
 
+        if (rerank)
+            found = rerank_candidates(shared->predictor_file, shared->ds, shared->n, forecast, closest, found);
+
         // Reconstruir dados (thread-safe)
         int created_data_index = forecast - shared->ds->start_prediction;
         recreate_data(shared->predicted_file, shared->ds, closest, created_data_index, shared->n, found);
@@ -2106,6 +3096,8 @@ void *kdanen_dependent_parallel_worker_interleaved(void *arg)
         worker->processed_count++;
     }
 
+    free(local_ds.target_window);
+
     gettimeofday(&worker_end, 0);
     worker->processing_time = (worker_end.tv_sec - worker_start.tv_sec) +
                               (worker_end.tv_usec - worker_start.tv_usec) * 1e-6;
@@ -2133,7 +3125,6 @@ void *kdanen_dependent_parallel_worker_interleaved(void *arg)
 void kdanen_dependent_parallel_interleaved(NetCDF *file, DataSegment *ds)
 {
     NetCDF *predicted_file = &file[0];
-    NetCDF *predictor_file = &file[1]; // Primeira série preditora como referência
 
     // Criar pool global de nós
     MultiSeriesNodePool *global_pool = create_multiseries_node_pool();
@@ -2145,6 +3136,8 @@ void kdanen_dependent_parallel_interleaved(NetCDF *file, DataSegment *ds)
 
     for (int n = 1; n - 1 < predicted_file->nvars - 13; n++)
     {
+        acquire_processing_variable(file, ds, n);
+
         if (predicted_file->var[n].invalid_percentage <= (double)15 &&
             predicted_file->var[n].invalid_percentage != (double)0)
         {
@@ -2152,47 +3145,11 @@ void kdanen_dependent_parallel_interleaved(NetCDF *file, DataSegment *ds)
             unsigned int length = (ds->end_prediction - ds->start_prediction) + 1;
 
             // Reset do pool para esta iteração
-            global_pool->next_available = 0;
+            node_arena_reset(global_pool);
 
             // ========== ALOCAÇÃO DE MEMÓRIA ==========
-            switch (predictor_file->var[n].type)
-            {
-                ALLOCATE_MEMORY_REC_DATA(NC_BYTE, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_CHAR, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_SHORT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_INT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_FLOAT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_DOUBLE, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_UBYTE, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_USHORT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_UINT, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_INT64, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_UINT64, length);
-                ALLOCATE_MEMORY_REC_DATA(NC_STRING, length);
-            default:
-                predicted_file->var[n].created_data = malloc(length * sizeof(float));
-                break;
-            }
-
-            if (!predicted_file->var[n].created_data)
-                continue;
-
-            // Inicializar com NaN
-            for (int i = 0; i < length; i++)
-            {
-                switch (predictor_file->var[n].type)
-                {
-                case NC_FLOAT:
-                    ((float *)predicted_file->var[n].created_data)[i] = NAN;
-                    break;
-                case NC_DOUBLE:
-                    ((double *)predicted_file->var[n].created_data)[i] = NAN;
-                    break;
-                default:
-                    ((float *)predicted_file->var[n].created_data)[i] = NAN;
-                    break;
-                }
-            }
+            if (!allocate_created_data(predicted_file, n, length))
+                goto discard;
 
             // ========== CONSTRUIR KD-TREE ENTRELAÇADA ==========
             struct timeval begin_tree, end_tree;
@@ -2204,39 +3161,35 @@ void kdanen_dependent_parallel_interleaved(NetCDF *file, DataSegment *ds)
             int valid_training_points = 0;
 
             if (!training_indices)
-                continue;
-
-            // Validar janelas em TODAS as séries preditoras
-            for (int analog = ds->start_training; analog <= ds->end_training; analog++)
-            {
-                bool all_series_valid = true;
+                goto discard;
 
-                for (int series = 1; series < ds->argc && all_series_valid; series++)
-                {
-                    if (!validate_window_simple(&file[series].var[n], analog, ds->k,
-                                                ds->win_size, file[series].dim->len))
-                    {
-                        all_series_valid = false;
-                    }
-                }
+            // Validar janelas em TODAS as séries preditoras (AND dos índices de validade)
+            valid_training_points = collect_valid_windows(file, 1, ds->argc, n, ds->start_training,
+                                                          ds->end_training, training_indices);
 
-                if (all_series_valid)
-                {
-                    training_indices[valid_training_points++] = analog;
-                }
+            // Matriz de super janelas do treino: a árvore passa a indexar linhas
+            free_window_matrix(ds->windows);
+            ds->windows = NULL;
+            if (ds->window_matrix && valid_training_points > 0)
+            {
+                ds->windows = build_window_matrix(file, ds, n, training_indices, valid_training_points, true);
+                for (int r = 0; r < valid_training_points; r++)
+                    training_indices[r] = r;
             }
 
             // Construir KD-Tree balanceada com LAYOUT ENTRELAÇADO
             KDTreeMultiSeries *root = NULL;
             if (valid_training_points > 0)
             {
+                // Um nó por janela válida, num bloco só
+                node_arena_reserve(global_pool, valid_training_points);
                 root = build_multiseries_balanced_kdtree_interleaved(training_indices, valid_training_points,
                                                                      file, ds, 0, global_pool, n);
             }
 
             free(training_indices);
             if (!root)
-                continue;
+                goto discard;
 
             gettimeofday(&end_tree, 0);
 
@@ -2246,32 +3199,16 @@ void kdanen_dependent_parallel_interleaved(NetCDF *file, DataSegment *ds)
             int num_valid_forecasts = 0;
 
             if (!valid_forecasts)
-                continue;
-
-            // Validar forecasts em TODAS as séries preditoras
-            for (int forecast = ds->start_prediction; forecast <= ds->end_prediction; forecast++)
-            {
-                bool all_series_valid = true;
-
-                for (int series = 1; series < ds->argc && all_series_valid; series++)
-                {
-                    if (!validate_window_simple(&file[series].var[n], forecast, ds->k,
-                                                ds->win_size, file[series].dim->len))
-                    {
-                        all_series_valid = false;
-                    }
-                }
+                goto discard;
 
-                if (all_series_valid)
-                {
-                    valid_forecasts[num_valid_forecasts++] = forecast;
-                }
-            }
+            // Validar forecasts em TODAS as séries preditoras (AND dos índices de validade)
+            num_valid_forecasts = collect_valid_windows(file, 1, ds->argc, n, ds->start_prediction,
+                                                        ds->end_prediction, valid_forecasts);
 
             if (num_valid_forecasts == 0)
             {
                 free(valid_forecasts);
-                continue;
+                goto discard;
             }
 
             // ========== PROCESSAMENTO PARALELO ==========
@@ -2348,10 +3285,19 @@ void kdanen_dependent_parallel_interleaved(NetCDF *file, DataSegment *ds)
             predicted_file->var[n].rmse = NAN;
             printf("NaN,");
         }
+
+        release_processing_variable(file, ds, n);
+        continue;
+
+    discard:
+        // Saída antecipada: libera a variável sem a série incompleta
+        discard_processing_variable(file, ds, n);
     }
 
     // Liberar pool global
-    free(global_pool);
+    free_window_matrix(ds->windows);
+    ds->windows = NULL;
+    node_arena_free(global_pool);
 }
 
 /**
@@ -1,4 +1,26 @@
 #include "randw.h"
+#include "ncmmap.h"
+#include "nccache.h"
+#include "preprocess.h"
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* libnetcdf is not assumed thread-safe: readers and the writer serialize on it */
+pthread_mutex_t netcdf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Tasks of the ingestion threads: variables [first_var, last_var) of files [next_file, last_file) */
+typedef struct
+{
+    NetCDF *file;
+    DataSegment *ds;
+    variable_func func;
+    int next_file;
+    int next_var;
+    int last_file;
+    int first_var;
+    int last_var; // 0 = up to nvars of each file
+    pthread_mutex_t lock;
+} IngestQueue;
 
 /*
  * Function to handle NetCDF errors, by printing an error message and exiting
@@ -15,7 +37,24 @@ void handle_error(int status)
 
 NetCDF *create_struct(DataSegment *ds, char *argv[])
 {
-    NetCDF *file = (NetCDF *)malloc(ds->argc * sizeof(NetCDF));
+    /*
+     * A preprocessed image of the same files and parameters, served in
+     * shared memory or cached on disk, replaces all of the reading.
+     */
+    if (ds->use_shm)
+    {
+        NetCDF *served = nccache_attach(ds, argv);
+        if (served)
+            return served;
+    }
+    if (ds->use_cache)
+    {
+        NetCDF *cached = nccache_load(ds, argv);
+        if (cached)
+            return cached;
+    }
+
+    NetCDF *file = (NetCDF *)calloc(ds->argc, sizeof(NetCDF));
 
     if (file == NULL)
     {
@@ -25,17 +64,61 @@ NetCDF *create_struct(DataSegment *ds, char *argv[])
 
     for (int i = 0; i < (ds->argc); i++)
     {
+        file[i].store_type = ds->store_type;
+
+        /*
+         * NetCDF-3 files are mapped and parsed directly (zero-copy);
+         * anything else (NetCDF-4/HDF5) goes through libnetcdf.
+         */
+        if (!ds->use_mmap || !ncmap_open(&file[i], argv[i]))
+        {
+            /*
+             * Open the input NetCDF file
+             * NC_NOWRITE tells NetCDF we want read-only access to the file
+             */
+            handle_error(nc_open(argv[i], NC_NOWRITE, &file[i].ncid_in));
+
+            read_header_file(&file[i], ds);
+        }
+
         /*
-         * Open the input NetCDF file
-         * NC_NOWRITE tells NetCDF we want read-only access to the file
+         * Slab reading: only [start - k, end + k] of the periods is read
+         * (resolved on the time axis of the first file) and the indices of
+         * ds are rebased to it.
          */
-        handle_error(nc_open(argv[i], NC_NOWRITE, &file[i].ncid_in));
+        if (ds->read_slab)
+        {
+            if (i == 0)
+            {
+                select_slab(&file[0], ds);
+            }
+            else
+            {
+                size_t len = file[i].dim->len;
+                file[i].offset = file[0].offset < len ? file[0].offset : len;
+                if (file[i].offset + file[0].dim->len < len)
+                    file[i].dim->len = file[0].dim->len;
+                else
+                    file[i].dim->len = len - file[i].offset;
+            }
+        }
 
-        read_header_file(&file[i], ds);
-        read_data_file(&file[i], ds);
+        /* The time axis first: slabs and interpolation depend on it */
+        read_variable(&file[i], 0, file[i].offset, file[i].dim->len);
         // printf("file: %s.\n", argv[i]);
     }
 
+    if (!ds->read_slab)
+        set_periods(file, ds);
+
+    /*
+     * Lazy loading: the other variables are materialized by
+     * acquire_variable when first used. Otherwise they are read and
+     * preprocessed here, concurrently across files and variables.
+     */
+    if (ds->load_all)
+        ingest_variables(file, ds);
+
     return file;
 }
 void *allocate_memory(char type, size_t len)
@@ -89,18 +172,50 @@ void deallocate_memory(NetCDF *file, int argc)
 
         for (int j = 0; j < file[i].nvars; j++)
         {
-            free(var[j].data);
+            if (var[j].storage == DATA_HEAP)
+                free(var[j].data);
+            else if (var[j].storage == DATA_RESERVED)
+                release_variable(&file[i], j);
             var[j].data = NULL;
+            release_valid_windows(&var[j]);
         }
         free(var);
         var = NULL;
         file[i].var = NULL;
-        
+        release_time_index(&file[i]);
+
         /* Close the file, freeing all resources. */
-        handle_error(nc_close(file[i].ncid_in));
+        if (file[i].map)
+            ncmap_close(&file[i]);
+        else if (!file[i].cache)
+            handle_error(nc_close(file[i].ncid_in));
     }
+    /* The image mapping is shared by all the files */
+    if (argc > 0 && file[0].cache)
+        nccache_close(&file[0]);
     free(file);
 }
+size_t data_type_size(nc_type type)
+{
+    switch (type)
+    {
+        TYPE_SIZE(NC_BYTE);
+        TYPE_SIZE(NC_CHAR);
+        TYPE_SIZE(NC_SHORT);
+        TYPE_SIZE(NC_INT);
+        TYPE_SIZE(NC_FLOAT);
+        TYPE_SIZE(NC_DOUBLE);
+        TYPE_SIZE(NC_UBYTE);
+        TYPE_SIZE(NC_USHORT);
+        TYPE_SIZE(NC_UINT);
+        TYPE_SIZE(NC_INT64);
+        TYPE_SIZE(NC_UINT64);
+        TYPE_SIZE(NC_STRING);
+    default:
+        fprintf(stderr, "Error: Unknown data type.\n");
+        exit(EXIT_FAILURE);
+    }
+}
 void read_dimensions(NetCDF *file)
 {
     file->dim = (Dimension *)malloc(file->ndims * sizeof(Dimension));
@@ -113,7 +228,7 @@ void read_dimensions(NetCDF *file)
 }
 void read_variables(NetCDF *file)
 {
-    file->var = (Variable *)malloc(file->nvars * sizeof(Variable));
+    file->var = (Variable *)calloc(file->nvars, sizeof(Variable));
     Variable *var = file->var;
     /* Get variables and yours attributes */
     for (int i = 0; i < file->nvars; i++)
@@ -141,63 +256,404 @@ void read_header_file(NetCDF *file, DataSegment *ds)
     /* Get the number of variables in the file */
     read_variables(file);
 }
-void read_data_file(NetCDF *file, DataSegment *ds)
+void read_variable(NetCDF *file, int i, size_t start, size_t count)
 {
-    Variable *var = file->var;
+    Variable *var = &file->var[i];
+    size_t nc_start[1] = {start};
+    size_t nc_count[1] = {count};
 
-    // Copiando os dados das variáveis
-    for (int i = 0; i < file->nvars; i++)
+    if (var->storage == DATA_HEAP)
+        free(var->data);
+    var->data = NULL;
+
+    /* The lookup belongs to the axis being replaced */
+    if (i == 0)
+        release_time_index(file);
+
+    /* Mapped files: data comes straight from the mapping */
+    if (file->map)
+    {
+        ncmap_variable_data(file, i, start, count);
+        if (file->store_type && i > 0)
+            normalize_variable(file, i, count);
+        return;
+    }
+
+    var->data = allocate_memory(var->type, count);
+    var->storage = DATA_HEAP;
+
+    // Alocando memória para os dados e copiando
+    pthread_mutex_lock(&netcdf_lock);
+    switch (var->type)
+    {
+    case NC_BYTE:
+        handle_error(nc_get_vara_schar(file->ncid_in, var->id, nc_start, nc_count, var->data));
+        break;
+    case NC_CHAR:
+        handle_error(nc_get_vara_text(file->ncid_in, var->id, nc_start, nc_count, var->data));
+        break;
+    case NC_SHORT:
+        handle_error(nc_get_vara_short(file->ncid_in, var->id, nc_start, nc_count, var->data));
+        break;
+    case NC_INT:
+        handle_error(nc_get_vara_int(file->ncid_in, var->id, nc_start, nc_count, var->data));
+        break;
+    case NC_FLOAT:
+        handle_error(nc_get_vara_float(file->ncid_in, var->id, nc_start, nc_count, var->data));
+        break;
+    case NC_DOUBLE:
+        handle_error(nc_get_vara_double(file->ncid_in, var->id, nc_start, nc_count, var->data));
+        break;
+    case NC_UBYTE:
+        handle_error(nc_get_vara_uchar(file->ncid_in, var->id, nc_start, nc_count, var->data));
+        break;
+    case NC_USHORT:
+        handle_error(nc_get_vara_ushort(file->ncid_in, var->id, nc_start, nc_count, var->data));
+        break;
+    case NC_UINT:
+        handle_error(nc_get_vara_uint(file->ncid_in, var->id, nc_start, nc_count, var->data));
+        break;
+    case NC_INT64:
+        handle_error(nc_get_vara_longlong(file->ncid_in, var->id, nc_start, nc_count, var->data));
+        break;
+    case NC_UINT64:
+        handle_error(nc_get_vara_ulonglong(file->ncid_in, var->id, nc_start, nc_count, var->data));
+        break;
+    case NC_STRING:
+        handle_error(nc_get_vara_string(file->ncid_in, var->id, nc_start, nc_count, var->data));
+        break;
+    default:
+        fprintf(stderr, "Unknown variable type.\n");
+        exit(1);
+    }
+    pthread_mutex_unlock(&netcdf_lock);
+
+    if (file->store_type && i > 0)
+        normalize_variable(file, i, count);
+}
+/*
+ * Convert the len elements of data variable i (as read by read_variable)
+ * to file->store_type (float32 or double) in a
+ * STORE_ALIGNMENT aligned buffer, so that every data variable shares one
+ * element type. The time axis (variable 0) keeps its type.
+ */
+void normalize_variable(NetCDF *file, int i, size_t len)
+{
+    Variable *var = &file->var[i];
+    size_t bytes = len * (file->store_type == NC_DOUBLE ? sizeof(double) : sizeof(float));
+    void *data = NULL;
+
+    if (var->type == NC_CHAR || var->type == NC_STRING)
+        return;
+    if (var->type == file->store_type && (uintptr_t)var->data % STORE_ALIGNMENT == 0)
+        return;
+
+    data = aligned_alloc(STORE_ALIGNMENT, (bytes + STORE_ALIGNMENT - 1) / STORE_ALIGNMENT * STORE_ALIGNMENT);
+    if (data == NULL)
     {
-        var[i].data = allocate_memory(var[i].type, file->dim->len);
+        fprintf(stderr, "Error: Failed to allocate memory.\n");
+        exit(EXIT_FAILURE);
+    }
 
-        if (var[i].data == NULL)
+    if (file->store_type == NC_DOUBLE)
+    {
+        switch (var->type)
         {
-            fprintf(stderr, "Error: Variable memory allocation failed.\n");
-            exit(1);
+            NORMALIZE_DATA(NC_BYTE, double);
+            NORMALIZE_DATA(NC_SHORT, double);
+            NORMALIZE_DATA(NC_INT, double);
+            NORMALIZE_DATA(NC_FLOAT, double);
+            NORMALIZE_DATA(NC_DOUBLE, double);
+            NORMALIZE_DATA(NC_UBYTE, double);
+            NORMALIZE_DATA(NC_USHORT, double);
+            NORMALIZE_DATA(NC_UINT, double);
+            NORMALIZE_DATA(NC_INT64, double);
+            NORMALIZE_DATA(NC_UINT64, double);
         }
+    }
+    else
+    {
+        switch (var->type)
+        {
+            NORMALIZE_DATA(NC_BYTE, float);
+            NORMALIZE_DATA(NC_SHORT, float);
+            NORMALIZE_DATA(NC_INT, float);
+            NORMALIZE_DATA(NC_FLOAT, float);
+            NORMALIZE_DATA(NC_DOUBLE, float);
+            NORMALIZE_DATA(NC_UBYTE, float);
+            NORMALIZE_DATA(NC_USHORT, float);
+            NORMALIZE_DATA(NC_UINT, float);
+            NORMALIZE_DATA(NC_INT64, float);
+            NORMALIZE_DATA(NC_UINT64, float);
+        }
+    }
+
+    /* Give the original buffer (or mapped pages) back */
+    if (file->map)
+        ncmap_release_variable(file, i);
+    else
+        free(var->data);
+
+    var->data = data;
+    var->type = file->store_type;
+    var->storage = DATA_HEAP;
+}
+void read_data_file(NetCDF *file, DataSegment *ds)
+{
+    // Copiando os dados das variáveis
+    for (int i = 0; i < file->nvars; i++)
+        read_variable(file, i, file->offset, file->dim->len);
+}
+/* Last variable (exclusive) of file f in the queue */
+static int last_ingest_var(IngestQueue *queue, int f)
+{
+    int nvars = queue->file[f].nvars;
+
+    return queue->last_var > 0 && queue->last_var < nvars ? queue->last_var : nvars;
+}
+static bool next_ingest_task(IngestQueue *queue, int *f, int *i)
+{
+    bool found = false;
 
-        // Alocando memória para os dados e copiando
-        switch (var[i].type)
+    pthread_mutex_lock(&queue->lock);
+    while (queue->next_file < queue->last_file)
+    {
+        if (queue->next_var < last_ingest_var(queue, queue->next_file))
         {
-        case NC_BYTE:
-        case NC_CHAR:
-            nc_get_var_text(file->ncid_in, var[i].id, var[i].data);
-            break;
-        case NC_SHORT:
-            nc_get_var_short(file->ncid_in, var[i].id, var[i].data);
-            break;
-        case NC_INT:
-            nc_get_var_int(file->ncid_in, var[i].id, var[i].data);
-            break;
-        case NC_FLOAT:
-            nc_get_var_float(file->ncid_in, var[i].id, var[i].data);
-            break;
-        case NC_DOUBLE:
-            nc_get_var_double(file->ncid_in, var[i].id, var[i].data);
-            break;
-        case NC_UBYTE:
-            nc_get_var_uchar(file->ncid_in, var[i].id, var[i].data);
-            break;
-        case NC_USHORT:
-            nc_get_var_ushort(file->ncid_in, var[i].id, var[i].data);
-            break;
-        case NC_UINT:
-            nc_get_var_uint(file->ncid_in, var[i].id, var[i].data);
-            break;
-        case NC_INT64:
-            nc_get_var_longlong(file->ncid_in, var[i].id, var[i].data);
-            break;
-        case NC_UINT64:
-            nc_get_var_ulonglong(file->ncid_in, var[i].id, var[i].data);
-            break;
-        case NC_STRING:
-            nc_get_var_string(file->ncid_in, var[i].id, var[i].data);
+            *f = queue->next_file;
+            *i = queue->next_var++;
+            found = true;
             break;
-        default:
-            fprintf(stderr, "Unknown variable type.\n");
+        }
+        queue->next_file++;
+        queue->next_var = queue->first_var;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return found;
+}
+static void *ingest_worker(void *arg)
+{
+    IngestQueue *queue = (IngestQueue *)arg;
+    DataSegment ds = *queue->ds; // Private copy: indice_generic changes per task
+    int f, i;
+
+    while (next_ingest_task(queue, &f, &i))
+    {
+        ds.indice_generic = f;
+        queue->func(&queue->file[f], &ds, i);
+    }
+
+    return NULL;
+}
+/*
+ * Run func over variables [first_var, last_var) (last_var = 0: all of
+ * them) of files [first_file, last_file), num_thread workers pulling
+ * (file, variable) tasks; a single worker runs in the calling thread.
+ * func loads the variable if it needs it (acquire_variable) and must
+ * only touch its own variable.
+ */
+void parallel_file_variables(NetCDF *file, DataSegment *ds, int first_file, int last_file,
+                             int first_var, int last_var, variable_func func, int num_thread)
+{
+    IngestQueue queue = {file, ds, func, first_file, first_var, last_file, first_var, last_var};
+    int tasks = 0;
+
+    for (int f = first_file; f < last_file; f++)
+        if (last_ingest_var(&queue, f) > first_var)
+            tasks += last_ingest_var(&queue, f) - first_var;
+    if (num_thread > tasks)
+        num_thread = tasks;
+    if (num_thread < 1)
+        return;
+
+    pthread_mutex_init(&queue.lock, NULL);
+
+    if (num_thread == 1)
+    {
+        ingest_worker(&queue);
+        pthread_mutex_destroy(&queue.lock);
+        return;
+    }
+
+    pthread_t threads[num_thread];
+
+    for (int t = 0; t < num_thread; t++)
+    {
+        if (pthread_create(&threads[t], NULL, ingest_worker, &queue) != 0)
+        {
+            fprintf(stderr, "Error: Failed to create worker thread %d.\n", t);
             exit(1);
         }
     }
+    for (int t = 0; t < num_thread; t++)
+        pthread_join(threads[t], NULL);
+
+    pthread_mutex_destroy(&queue.lock);
+}
+/* Every data variable of every file */
+void parallel_variables(NetCDF *file, DataSegment *ds, variable_func func, int num_thread)
+{
+    parallel_file_variables(file, ds, 0, ds->argc, 1, 0, func, num_thread);
+}
+void ingest_variables(NetCDF *file, DataSegment *ds)
+{
+    int num_thread = ds->num_io_thread > 0 ? ds->num_io_thread : (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    parallel_variables(file, ds, preprocess_variable, num_thread);
+}
+void *acquire_variable(NetCDF *file, int i)
+{
+    Variable *var = &file->var[i];
+
+    if (var->data == NULL)
+        read_variable(file, i, file->offset, file->dim->len);
+
+    return var->data;
+}
+void release_variable(NetCDF *file, int i)
+{
+    Variable *var = &file->var[i];
+
+    if (var->data == NULL)
+        return;
+
+    /* The streaming state goes with the column: the variable is raw again */
+    if (var->storage == DATA_RESERVED)
+    {
+        munmap(var->data, file->dim->len * data_type_size(var->type));
+        free(var->stream);
+        var->stream = NULL;
+        var->data = NULL;
+        var->type = var->file_type;
+        var->storage = DATA_HEAP;
+        var->ready = false;
+        return;
+    }
+
+    if (file->cache)
+    {
+        nccache_release_variable(file, i);
+        return;
+    }
+
+    if (file->map)
+    {
+        ncmap_release_variable(file, i);
+        return;
+    }
+
+    free(var->data);
+    var->data = NULL;
+}
+/*
+ * Chunked prediction: variable i gets an anonymous mapping as large as the
+ * whole slab, in the type read_variable would leave it in. It is filled
+ * range by range (read_variable_range); only the ranges loaded and not
+ * yet dropped (drop_variable_range) take memory, while the indices stay
+ * those of the slab.
+ */
+void reserve_variable(NetCDF *file, int i)
+{
+    Variable *var = &file->var[i];
+    nc_type type = var->type;
+    void *data;
+
+    release_variable(file, i);
+
+    if (file->store_type && var->type != NC_CHAR && var->type != NC_STRING)
+        type = file->store_type;
+
+    data = mmap(NULL, file->dim->len * data_type_size(type), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (data == MAP_FAILED)
+    {
+        fprintf(stderr, "Error: Failed to reserve memory for %s.\n", var->name);
+        exit(1);
+    }
+
+    var->file_type = var->type;
+    var->type = type;
+    var->data = data;
+    var->storage = DATA_RESERVED;
+}
+/* Load [start, start + count) of the slab into the reserved variable i */
+void read_variable_range(NetCDF *file, int i, size_t start, size_t count)
+{
+    Variable *var = &file->var[i];
+    unsigned char *column = (unsigned char *)var->data;
+    nc_type type = var->type;
+    size_t size = data_type_size(type);
+
+    if (count == 0)
+        return;
+
+    /* Read (and normalize) as a regular variable of count elements */
+    var->data = NULL;
+    var->type = var->file_type;
+    var->storage = DATA_HEAP;
+    read_variable(file, i, file->offset + start, count);
+
+    memcpy(column + start * size, var->data, count * size);
+
+    if (var->storage == DATA_MAPPED)
+        ncmap_release_variable(file, i);
+    else
+        free(var->data);
+
+    var->data = column;
+    var->type = type;
+    var->storage = DATA_RESERVED;
+}
+/*
+ * Give back the whole pages of [start, end) of the reserved variable i.
+ * Returns the element where the dropped pages end (start if none), from
+ * where the next drop should continue.
+ */
+size_t drop_variable_range(NetCDF *file, int i, size_t start, size_t end)
+{
+    Variable *var = &file->var[i];
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = data_type_size(var->type);
+    size_t page_lo = (start * size + page - 1) / page * page;
+    size_t page_hi = end * size / page * page;
+
+    if (page_lo >= page_hi)
+        return start;
+
+    madvise((unsigned char *)var->data + page_lo, page_hi - page_lo, MADV_DONTNEED);
+    return page_hi / size;
+}
+void select_slab(NetCDF *file, DataSegment *ds)
+{
+    /* The time axis is loaded first to resolve the periods */
+    read_variable(file, 0, 0, file->dim->len);
+    set_periods(file, ds);
+
+    /* Invalid periods are reported by the caller; keep the whole series */
+    if (ds->start_training < 0 || ds->end_training < 0 ||
+        ds->start_prediction < 0 || ds->end_prediction < 0)
+        return;
+
+    /*
+     * Slab = every window of both periods plus a halo, so that gaps up to
+     * win_size_interpolation next to the first/last window still have both
+     * interpolation anchors loaded.
+     */
+    int halo = ds->k + ds->win_size_interpolation + 1;
+    int first = ds->start_training < ds->start_prediction ? ds->start_training : ds->start_prediction;
+    int last = ds->end_training > ds->end_prediction ? ds->end_training : ds->end_prediction;
+    size_t lo = first - halo > 0 ? (size_t)(first - halo) : 0;
+    size_t hi = (size_t)(last + halo) < file->dim->len ? (size_t)(last + halo) : file->dim->len - 1;
+
+    file->offset = lo;
+    file->dim->len = hi - lo + 1;
+
+    /* Rebase the period indices to the slab */
+    ds->start_training -= lo;
+    ds->end_training -= lo;
+    ds->start_prediction -= lo;
+    ds->end_prediction -= lo;
 }
 void write_file(NetCDF *file, char *argv)
 {
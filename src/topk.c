@@ -0,0 +1,39 @@
+#include "topk.h"
+
+/*
+ * Offers count candidates in order, as many topk_push calls would: a
+ * candidate enters only if its distance is below the threshold at that
+ * point (so NaN never does). Each pass first compacts, branch-free, the
+ * positions below the current threshold into a buffer; the threshold
+ * only decreases, so the buffered candidates are checked again as they
+ * are pushed. Returns how many were kept.
+ */
+int topk_push_batch(ClosestPoint *closest, int *found, int capacity,
+                    const int *window_index, const double *distance, int count)
+{
+    int buffer[TOPK_BATCH];
+    int kept = 0;
+
+    for (int first = 0; first < count; first += TOPK_BATCH)
+    {
+        int length = count - first < TOPK_BATCH ? count - first : TOPK_BATCH;
+        double threshold = topk_threshold(closest, *found, capacity);
+        int selected = 0;
+
+        for (int j = 0; j < length; j++)
+        {
+            buffer[selected] = first + j;
+            selected += distance[first + j] < threshold;
+        }
+
+        for (int j = 0; j < selected; j++)
+        {
+            int c = buffer[j];
+
+            if (distance[c] < topk_threshold(closest, *found, capacity))
+                kept += topk_push(closest, found, capacity, window_index[c], distance[c]);
+        }
+    }
+
+    return kept;
+}
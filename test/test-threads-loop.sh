@@ -21,5 +21,36 @@ function slaptime(){
 	done
 }
 
+function slaptime_shm(){
+	FILENAME=test/$1.$DATEPLUS".csv"
+	echo "" > $FILENAME
+
+	echo n_loop,n_files,n_threads,t_rdfiles,s_training,e_training,s_prediction,e_prediction,rmse,t_total >> $FILENAME
+
+	for t in 1 2 4 8; do # training period in years
+		# one resident server per training period; the runs attach its shared memory
+		bin/generic_app serve $t $(ls support/nc_data/-*.nc) > /dev/null 2> $FILENAME.serve &
+		SERVER=$!
+		until grep -q Serving $FILENAME.serve; do
+			kill -0 $SERVER 2> /dev/null || { cat $FILENAME.serve; exit 1; } # server exited early
+			sleep 1
+		done
+
+		for i in $(seq 1 $2); do # threads number
+			for j in $(seq 1 $3); do # how many times
+			echo "countdown - test" $i - $j
+			sleep 5
+
+			echo $j,$(bin/generic_app $i $t $(ls support/nc_data/-*.nc)) >> $FILENAME
+
+			done
+		done
+
+		kill $SERVER
+		wait $SERVER
+	done
+	rm -f $FILENAME.serve
+}
+
 $1 $2 $3 $4
 # echo 0:$0 1:$1 2:$2 3:$3 4:$4 5:$5
\ No newline at end of file